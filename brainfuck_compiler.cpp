@@ -1,39 +1,54 @@
 #include <iostream>
 #include <fstream>
-#include <stack>
+#include <sstream>
+#include <vector>
 #include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "fuel.h"
+#include "loader.h"
+#include "phase_timer.h"
+#include "program_cache.h"
 
 using namespace std;
 
 bool enable_profiler = false;
+bool enable_phase_summary = false;
+bool enable_cache = false;
+
+// Instruction budget compiled into the program, -1 for none. Like the interpreters, every loop
+// iteration charges the length of its body at the back-edge, using r12 as the counter.
+long long fuel_budget = -1;
+
+// Threads generating code, and the smallest region of the program worth handing to a thread
+unsigned int thread_count = thread::hardware_concurrency();
+const size_t min_region_size = 64 * 1024;
+string trace_file;
 
-unordered_map<int, int> loop_map;
+phase_timer timer;
+
+vector<int32_t> loop_map;
 unordered_map<string, int> non_simple_loops;
 unordered_map<string, int > simple_loops;
 unordered_map<string, string> optimizations;
 
 
-// Function to open file and read content
-string read_file(const string &file_name) {
-  ifstream file(file_name);
-  if (!file.is_open()) {
+// Function to map the file content, release it with unmap_file
+const char *read_file(const string &file_name, size_t &length) {
+  const char *content = map_file(file_name.c_str(), &length);
+  if (!content) {
     cerr << "Error opening file: " << file_name << endl;
     exit(1);
   }
-  string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-  file.close();
   return content;
 }
 
 // Function to filter and return only '+-<>,.[]' characters from the text
-string filter_text(const string &text) {
-  string filtered;
-  filtered.reserve(text.size());
-  for (char ch : text) {
-    if (ch == '+' || ch == '-' || ch == '<' || ch == '>' || ch == ',' || ch == '.' || ch == '[' || ch == ']') {
-      filtered += ch;
-    }
-  }
+string filter_text(const char *text, size_t length) {
+  string filtered(length, '\0');
+  filtered.resize(filter_program(text, length, &filtered[0]));
   return filtered;
 }
 
@@ -46,27 +61,8 @@ void initialize_globals() {
 
 // Preprocessing to match loops and store their positions
 bool preprocess_loops(const string &text) {
-  stack<int> loop_stack;
-
-  for (int i = 0; i < text.size(); i++) {
-    if (text[i] == '[') {
-      loop_stack.push(i);
-    } else if (text[i] == ']') {
-      if (loop_stack.empty()) {
-        cerr << "Mismatched ']' at position " << i << endl;
-        exit(1);
-      }
-      int open_pos = loop_stack.top();
-      loop_map[open_pos] = i;
-      loop_stack.pop();
-      loop_map[i] = open_pos;
-    }
-  }
-
-  if (!loop_stack.empty()) {
-    cerr << "Mismatched '[' at position " << loop_stack.top() << endl;
-    exit(1);
-  }
+  loop_map.assign(text.size(), 0);
+  match_brackets(text.data(), text.size(), loop_map.data());
 
   if (enable_profiler) {
     bool is_inner_most_loop = false;
@@ -118,33 +114,35 @@ void add_optimizations() {
   optimizations["[-<<<<<<<<->>>>>>>>]"] = "   sub rsi, 8";
 }
 
-// Compiles brainfuck to x86_64 assembly
-void compile_program(const string &text, string output_file) {
-  if(output_file == "") {
-    output_file = "a.s";
+// Split the program into regions at top-level loop boundaries, each at least target_size long
+// (except the last), so every loop lies entirely inside one region
+vector<pair<int, int>> split_regions(const string &text, size_t target_size) {
+  vector<pair<int, int>> regions;
+  int begin = 0;
+  int depth = 0;
+  for (int ip = 0; ip < (int)text.size(); ip++) {
+    if (text[ip] == '[') {
+      depth++;
+    } else if (text[ip] == ']') {
+      depth--;
+    }
+    if (depth == 0 && ip + 1 - begin >= (int)target_size) {
+      regions.push_back({begin, ip + 1});
+      begin = ip + 1;
+    }
   }
-  ofstream asm_file(output_file);
-
-  // Assembly header
-  // Memory allocation section - Block start by symbol
-  asm_file << "section .bss\n";
-
-  // .lcomm directive allocates memory
-  asm_file << "   tape resb 30000\n";
-  asm_file << "section .text\n";
-  asm_file << "global _start\n";
-  asm_file << "_start:\n";
-  asm_file << "   mov rsi, tape ; Initialize data pointer\n";
-
-  stack<int> loop_stack;
-
-  // To name loops
-  int loop_counter = 0;
-  int curr_loop=0;
+  if (begin < (int)text.size()) {
+    regions.push_back({begin, (int)text.size()});
+  }
+  return regions;
+}
 
-  int ip = 0;  // instruction pointer
+// Emits the assembly for text[begin, end). Loops are labelled by the position of their '[' in
+// the whole program, so regions can be generated independently and still get unique labels.
+void compile_region(const string &text, int begin, int end, ostream &asm_file) {
+  int ip = begin;  // instruction pointer
 
-  while (ip < text.size()) {
+  while (ip < end) {
     char bf_op = text[ip];
     switch(bf_op) {
       case '>':
@@ -188,16 +186,12 @@ void compile_program(const string &text, string output_file) {
         asm_file << "   syscall" << endl;
         break;
       case '[':
-
-        // Start of a loop
-        loop_stack.push(loop_counter);
-        // Label the loop
-        asm_file << "loop_" << loop_counter << ":" << endl;
+        // Start of a loop, label the loop
+        asm_file << "loop_" << ip << ":" << endl;
         // Compare the byte at the data pointer to 0
         asm_file << "   cmp byte [rsi], 0" << endl;
         // Jump to the end of the loop if the byte is 0
-        asm_file << "   je loop_end_" << loop_counter << endl;
-        loop_counter++;
+        asm_file << "   je loop_end_" << ip << endl;
 
         if(enable_profiler) {
             if(non_simple_loops.find(text.substr(ip, loop_map[ip] - ip + 1)) != non_simple_loops.end()) {
@@ -208,21 +202,26 @@ void compile_program(const string &text, string output_file) {
             }
         }
         break;
-      case ']':
-        // End of a loop
-        if (loop_stack.empty()) {
-          cerr << "Unmatched ']' exiting" << endl;
-          return;
-        }
-        curr_loop = loop_stack.top();
-        loop_stack.pop();
+      case ']': {
+        // End of a loop, the brackets were matched by preprocess_loops
+        int curr_loop = loop_map[ip];
         // Label loop end
         asm_file << "loop_end_" << curr_loop << ":" << endl;
         // Compare the byte at the data pointer to 0
         asm_file << "   cmp byte [rsi], 0" << endl;
-        // Jump back to the start of the loop if the byte is not 0
-        asm_file << "   jne loop_" << curr_loop << endl;
+        if (fuel_budget >= 0) {
+          // Leave the loop if the byte is 0, otherwise charge the loop body and jump back while fuel is left
+          asm_file << "   je loop_exit_" << curr_loop << endl;
+          asm_file << "   sub r12, " << ip - curr_loop << endl;
+          asm_file << "   jns loop_" << curr_loop << endl;
+          asm_file << "   jmp out_of_fuel" << endl;
+          asm_file << "loop_exit_" << curr_loop << ":" << endl;
+        } else {
+          // Jump back to the start of the loop if the byte is not 0
+          asm_file << "   jne loop_" << curr_loop << endl;
+        }
         break;
+      }
       default:
         // Ignore any other character
         break;
@@ -230,6 +229,69 @@ void compile_program(const string &text, string output_file) {
 
     ip++; // Move to the next instruction
   }
+}
+
+// Compiles brainfuck to x86_64 assembly
+void compile_program(const string &text, string output_file) {
+  if(output_file == "") {
+    output_file = "a.s";
+  }
+  timer.begin("codegen");
+  ofstream asm_file(output_file);
+
+  // Assembly header
+  // Memory allocation section - Block start by symbol
+  asm_file << "section .bss\n";
+
+  // .lcomm directive allocates memory
+  asm_file << "   tape resb 30000\n";
+  if (fuel_budget >= 0) {
+    asm_file << "section .data\n";
+    asm_file << "   fuel_message db 10, \"Execution stopped: budget exhausted\", 10\n";
+    asm_file << "   fuel_message_length equ $ - fuel_message\n";
+  }
+  asm_file << "section .text\n";
+  asm_file << "global _start\n";
+  asm_file << "_start:\n";
+  asm_file << "   mov rsi, tape ; Initialize data pointer\n";
+  if (fuel_budget >= 0) {
+    asm_file << "   mov r12, " << fuel_budget << " ; Initialize fuel\n";
+  }
+
+  // The profiler counts loops in shared maps, so it compiles on a single thread
+  unsigned int threads = enable_profiler ? 1 : max(1u, thread_count);
+
+  // A few regions per thread keeps the threads busy when region sizes are uneven
+  timer.begin("split regions");
+  vector<pair<int, int>> regions = split_regions(text, max<size_t>(min_region_size, text.size() / (threads * 4)));
+  timer.end();
+
+  // Every worker takes the next region until none are left
+  timer.begin("emit regions");
+  vector<string> region_asm(regions.size());
+  atomic<size_t> next_region(0);
+  auto worker = [&]() {
+    for (size_t region = next_region++; region < regions.size(); region = next_region++) {
+      ostringstream region_file;
+      compile_region(text, regions[region].first, regions[region].second, region_file);
+      region_asm[region] = region_file.str();
+    }
+  };
+  vector<thread> pool;
+  for (unsigned int i = 1; i < min<size_t>(threads, regions.size()); i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (thread &t : pool) {
+    t.join();
+  }
+  timer.end();
+
+  timer.begin("write regions");
+  for (const string &region : region_asm) {
+    asm_file << region;
+  }
+  timer.end();
 
   // Close the program
   asm_file << "end_program:" << endl;
@@ -238,50 +300,148 @@ void compile_program(const string &text, string output_file) {
   asm_file << "    xor rdi, rdi ; exit code 0\n";
   asm_file << "    syscall ; invoke system call\n";
 
+  if (fuel_budget >= 0) {
+    // Out of fuel: report on stderr and exit with the same status as the interpreters
+    asm_file << "out_of_fuel:" << endl;
+    asm_file << "    mov rax, 1" << endl;
+    asm_file << "    mov rdi, 2" << endl;
+    asm_file << "    mov rsi, fuel_message" << endl;
+    asm_file << "    mov rdx, fuel_message_length" << endl;
+    asm_file << "    syscall" << endl;
+    asm_file << "    mov rax, 60" << endl;
+    asm_file << "    mov rdi, " << FUEL_EXHAUSTED_STATUS << endl;
+    asm_file << "    syscall" << endl;
+  }
+  timer.end();
+
+  timer.begin("flush");
   asm_file.close();
+  timer.end();
   cout << "Assembly code generated and written to " << output_file << endl;
 }
 
+// Copy a file through a temporary name, so readers never see a partial copy
+bool copy_file(const string &from, const string &to) {
+  ifstream source(from, ios::binary);
+  if (!source.is_open()) {
+    return false;
+  }
+  string temp = to + "." + to_string(getpid()) + ".tmp";
+  ofstream destination(temp, ios::binary);
+  destination << source.rdbuf();
+  destination.close();
+  if (!destination || rename(temp.c_str(), to.c_str()) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
       cerr << "Usage: " << argv[0] << " <file_name>" << endl;
       return 1;
     }
 
-    // Check for flag "-p" to enable profiler
-    if (argc == 4 && string(argv[3]) == "-p") {
-      enable_profiler = true;
+    // Check for flag "-p" to enable profiler, "--cache" to reuse the assembly from the program cache
+    // (ignored with "-p"), "--phases" to print the phase timings, "--trace <file>" to write them as a Chrome trace
+    // "--fuel <N>" to compile an instruction budget into the program and "--threads <N>" to set the number
+    // of threads generating code (all cores by default)
+    for (int i = 3; i < argc; i++) {
+      if (string(argv[i]) == "-p") {
+        enable_profiler = true;
+      } else if (string(argv[i]) == "--cache") {
+        enable_cache = true;
+      } else if (string(argv[i]) == "--phases") {
+        enable_phase_summary = true;
+      } else if (string(argv[i]) == "--trace" && i + 1 < argc) {
+        trace_file = argv[++i];
+      } else if (string(argv[i]) == "--fuel" && i + 1 < argc) {
+        fuel_budget = strtoll(argv[++i], nullptr, 10);
+      } else if (string(argv[i]) == "--threads" && i + 1 < argc) {
+        thread_count = strtoul(argv[++i], nullptr, 10);
+      }
     }
 
-    string text = read_file(argv[1]);
-    text = filter_text(text);
-    initialize_globals();
-    // Preprocess loop start and end positions
-    preprocess_loops(text);
-
-    // Add optimizations
-    add_optimizations();
-
-    if(enable_profiler) {
-      cout << "#Simple loops: " << simple_loops.size() << endl;
-      cout << "#Non-simple loops: " << non_simple_loops.size() << endl;
-      cout << endl;
+    timer.begin("load");
+    size_t source_length;
+    const char *source = read_file(argv[1], source_length);
+    timer.end();
+
+    // Look the generated assembly up in the program cache, a hit skips the whole pipeline
+    string output_file = argv[2];
+    char cache_path[4096];
+    bool use_cache = enable_cache && !enable_profiler;
+    if (use_cache) {
+      program_cache_key key;
+      use_cache = program_cache_hash(source, source_length, ("compiler-v2 fuel=" + to_string(fuel_budget)).c_str(),
+                                     &key) == 0 &&
+                  program_cache_path(cache_path, sizeof(cache_path), &key, "asm") == 0;
+    }
+    timer.begin("cache lookup");
+    bool cache_hit = use_cache && copy_file(cache_path, output_file);
+    timer.end();
+
+    if (cache_hit) {
+      cout << "Cached assembly code written to " << output_file << endl;
+      program_cache_touch(cache_path);
+      unmap_file(source, source_length);
+    } else {
+      timer.begin("filter");
+      string text = filter_text(source, source_length);
+      timer.end();
+      unmap_file(source, source_length); // Release the original unfiltered content
+
+      initialize_globals();
+      // Preprocess loop start and end positions
+      timer.begin("bracket match");
+      preprocess_loops(text);
+      timer.end();
+
+      // Add optimizations
+      timer.begin("optimizations");
+      add_optimizations();
+      timer.end();
+
+      if(enable_profiler) {
+        timer.begin("profile report");
+        cout << "#Simple loops: " << simple_loops.size() << endl;
+        cout << "#Non-simple loops: " << non_simple_loops.size() << endl;
+        cout << endl;
+
+        // Print the simple loop bodies
+        cout << "Simple loop bodies:" << endl;
+        for (auto &pair: simple_loops) {
+          cout << pair.first << ": " << pair.second << endl;
+        }
+        cout << endl;
 
-      // Print the simple loop bodies
-      cout << "Simple loop bodies:" << endl;
-      for (auto &pair: simple_loops) {
-        cout << pair.first << ": " << pair.second << endl;
+        // Print the non-simple loop bodies
+        cout << "Non-simple loop bodies:" << endl;
+        for (auto &pair: non_simple_loops) {
+          cout << pair.first << ": " << pair.second << endl;
+        }
+        timer.end();
       }
-      cout << endl;
 
-      // Print the non-simple loop bodies
-      cout << "Non-simple loop bodies:" << endl;
-      for (auto &pair: non_simple_loops) {
-        cout << pair.first << ": " << pair.second << endl;
+      compile_program(text, output_file);
+
+      if (use_cache) {
+        timer.begin("cache store");
+        if (copy_file(output_file, cache_path)) {
+          program_cache_trim();
+        }
+        timer.end();
       }
     }
 
-    compile_program(text, argv[2]);
+    if (enable_phase_summary) {
+      timer.print_summary(cerr);
+    }
+    if (!trace_file.empty() && !timer.write_trace(trace_file, argv[0])) {
+      cerr << "Error writing trace file: " << trace_file << endl;
+      return 1;
+    }
 
     return 0;
 }
@@ -3,75 +3,87 @@
 #include <string.h>
 #include <time.h>
 
-// Function to open file and read content
-char *read_file(const char *file_name) {
-  FILE *file = fopen(file_name, "r");
-  if (!file) {
-    fprintf(stderr, "Error opening file: %s\n", file_name);
-    exit(1);
-  }
+#include "checkpoint.h"
+#include "fuel.h"
+#include "loader.h"
+#include "perf_counters.h"
+#include "program_cache.h"
+
+#define TAPE_SIZE 30000
 
-  // Move file pointer to the end to determine file size
-  fseek(file, 0, SEEK_END);
-  long length = ftell(file);
-  fseek(file, 0, SEEK_SET);
+int enable_perf_counters = 0;
+int enable_cache = 0;
+perf_counters counters;
 
-  // Allocate memory for the file contents
-  char *content = (char *)malloc(length + 1);
+// Checkpointing: snapshot file, back-edges between snapshots (0 for signals only) and snapshot to resume from
+const char *checkpoint_file = NULL;
+unsigned long checkpoint_interval = 0;
+const char *resume_file = NULL;
+
+// Execution budget, charged at back-edges: instruction budget (-1 for none) and time limit in seconds (0 for none)
+int enable_fuel = 0;
+long long fuel_budget = -1;
+double time_limit = 0;
+fuel_meter fuel;
+
+// Function to map the file content, release it with unmap_file
+const char *read_file(const char *file_name, size_t *length) {
+  const char *content = map_file(file_name, length);
   if (!content) {
-    fprintf(stderr, "Memory allocation failed\n");
+    fprintf(stderr, "Error opening file: %s\n", file_name);
     exit(1);
   }
-
-  // Read the file into the buffer
-  fread(content, 1, length, file);
-  content[length] = '\0'; // Null-terminate the string
-
-  fclose(file);
   return content;
 }
 
 // Function to filter and return only '+-<>,.[]' characters from the text
-char *filter_text(const char *text) {
-  char *filtered = (char *)malloc(strlen(text) + 1);
+char *filter_text(const char *text, size_t length) {
+  char *filtered = (char *)malloc(length + 1);
   if (!filtered) {
     fprintf(stderr, "Memory allocation failed\n");
     exit(1);
   }
 
-  int j = 0;
-  for (int i = 0; text[i]; i++) {
-    if (strchr("+-<>,.[]", text[i])) {
-      filtered[j++] = text[i];
-    }
-  }
-  filtered[j] = '\0';
+  filtered[filter_program(text, length, filtered)] = '\0';
   return filtered;
 }
 
-// Preprocessing to match loops and store their positions
+// Preprocessing to match loops and store their positions, nesting depth is only limited by memory
 void preprocess_loops(const char *text, int *loop_map) {
-  int loop_stack[1024]; // Stack for storing loop start positions
-  int stack_ptr = -1;
-
-  for (int i = 0; text[i]; i++) {
-    if (text[i] == '[') {
-      loop_stack[++stack_ptr] = i; // Push position of '[' onto the stack
-    } else if (text[i] == ']') {
-      if (stack_ptr < 0) {
-        fprintf(stderr, "Mismatched ']' at position %d\n", i);
-        exit(1);
-      }
-      int open_pos = loop_stack[stack_ptr--]; // Pop the matching '[' position
-      loop_map[open_pos] = i; // Store matching positions
-      loop_map[i] = open_pos;
-    }
+  match_brackets(text, strlen(text), loop_map);
+}
+
+// Write a snapshot of the execution state, storing only the range of non-zero cells, and stop
+// the process if the snapshot was asked for with SIGTERM
+void save_checkpoint(uint64_t program_hash, int ip, int ptr, const int *tape,
+                     uint64_t input_offset, uint64_t output_offset) {
+  int first = 0;
+  int last = TAPE_SIZE - 1;
+  while (first < TAPE_SIZE && tape[first] == 0) first++;
+  while (last >= first && tape[last] == 0) last--;
+
+  unsigned char cells[TAPE_SIZE];
+  for (int i = first; i <= last; i++) {
+    cells[i - first] = (unsigned char)tape[i];
   }
 
-  if (stack_ptr >= 0) {
-    fprintf(stderr, "Mismatched '[' at position %d\n", loop_stack[stack_ptr]);
-    exit(1);
+  checkpoint_header header = {0};
+  header.program_hash = program_hash;
+  header.ip = ip;
+  header.ptr = ptr;
+  header.tape_size = TAPE_SIZE;
+  header.tape_start = first < TAPE_SIZE ? first : 0;
+  header.tape_length = last - first + 1 > 0 ? last - first + 1 : 0;
+  header.input_offset = input_offset;
+  header.output_offset = output_offset;
+  header.output_position = checkpoint_output_position();
+  if (checkpoint_save(checkpoint_file, &header, cells) != 0) {
+    fprintf(stderr, "Error writing checkpoint: %s\n", checkpoint_file);
   }
+  if (checkpoint_signal == SIGTERM) {
+    exit(128 + SIGTERM);
+  }
+  checkpoint_signal = 0;
 }
 
 // Function to parse and execute the brainfuck-like program
@@ -80,7 +92,39 @@ void parse_program(const char *text, const int *loop_map) {
   int ptr = 0; // memory pointer
 
   // Initialize tape with 30,000 cells to avoid frequent resizing
-  int tape[30000] = {0};
+  int tape[TAPE_SIZE] = {0};
+
+  // Stream offsets and back-edge count, only used for checkpoints
+  uint64_t program_hash = 0;
+  uint64_t input_offset = 0;
+  uint64_t output_offset = 0;
+  unsigned long back_edges = 0;
+
+  if (checkpoint_file || resume_file) {
+    program_hash = checkpoint_hash(text, strlen(text));
+  }
+
+  if (resume_file) {
+    checkpoint_header header;
+    size_t mapped_size;
+    const unsigned char *cells = checkpoint_load(resume_file, program_hash, TAPE_SIZE, &header, &mapped_size);
+    if (!cells) {
+      exit(1);
+    }
+    for (uint64_t i = 0; i < header.tape_length; i++) {
+      tape[header.tape_start + i] = cells[i];
+    }
+    checkpoint_unmap(cells, &header, mapped_size);
+    checkpoint_restore_streams(&header);
+    ip = (int)header.ip;
+    ptr = (int)header.ptr;
+    input_offset = header.input_offset;
+    output_offset = header.output_offset;
+  }
+
+  if (enable_perf_counters) {
+    perf_counters_start(&counters);
+  }
 
   // Process each character in the input program
   while (text[ip]) {
@@ -103,10 +147,23 @@ void parse_program(const char *text, const int *loop_map) {
 
       case '.':  // output the value at current cell as character
         putchar(tape[ptr]);
+        output_offset++;
         break;
 
       case ',':  // read a character from input into the current cell
-        tape[ptr] = getchar();
+        if (checkpoint_file) {
+          // A snapshot signal interrupts a blocked read, snapshot before the ',' and read again
+          int ch;
+          while ((ch = checkpoint_getchar()) == CHECKPOINT_READ_INTERRUPTED) {
+            if (checkpoint_signal) {
+              save_checkpoint(program_hash, ip, ptr, tape, input_offset, output_offset);
+            }
+          }
+          tape[ptr] = ch;
+        } else {
+          tape[ptr] = getchar();
+        }
+        input_offset++;
         break;
 
       case '[':  // begin loop
@@ -117,7 +174,17 @@ void parse_program(const char *text, const int *loop_map) {
 
       case ']':  // end loop
         if (tape[ptr] != 0) {
+          // Charge one iteration of the loop body against the budget
+          if (enable_fuel && (fuel.remaining -= ip - loop_map[ip]) < 0 && !fuel_refill(&fuel)) {
+            fuel_exhausted_exit();
+          }
           ip = loop_map[ip];  // jump back to the matching '['
+
+          // Snapshot on the back-edge, resuming continues after the '['
+          if (checkpoint_file && (++back_edges == checkpoint_interval || checkpoint_signal)) {
+            save_checkpoint(program_hash, ip + 1, ptr, tape, input_offset, output_offset);
+            back_edges = 0;
+          }
         }
         break;
 
@@ -127,6 +194,18 @@ void parse_program(const char *text, const int *loop_map) {
     }
     ip++; // move to the next instruction
   }
+
+  // A signal that arrived after the last back-edge is answered with a snapshot of the finished run
+  if (checkpoint_file) {
+    if (checkpoint_signal) {
+      save_checkpoint(program_hash, ip, ptr, tape, input_offset, output_offset);
+    }
+    checkpoint_restore_signal_handlers();
+  }
+
+  if (enable_perf_counters) {
+    perf_counters_stop(&counters);
+  }
 }
 
 // Main function to execute the program
@@ -136,37 +215,102 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Check for flag "--cache" to reuse the preprocessed program from the program cache,
+  // "--perf-counters" to read hardware counters around the execution,
+  // "--checkpoint <file>" and "--checkpoint-every <N>" to snapshot the execution on SIGUSR1/SIGTERM
+  // or every N back-edges, "--resume <file>" to continue from a snapshot, and "--fuel <N>" and
+  // "--time-limit <seconds>" to stop the execution once it has used up its budget
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--cache") == 0) {
+      enable_cache = 1;
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      enable_perf_counters = 1;
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpoint_file = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      checkpoint_interval = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      resume_file = argv[++i];
+    } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+      enable_fuel = 1;
+      fuel_budget = strtoll(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+      enable_fuel = 1;
+      time_limit = strtod(argv[++i], NULL);
+    }
+  }
+  if (enable_fuel) {
+    fuel_init(&fuel, fuel_budget, time_limit);
+  }
+  if (checkpoint_file) {
+    checkpoint_install_signal_handlers();
+  }
+  if (enable_perf_counters) {
+    perf_counters_open(&counters);
+  }
+
   // Record start time
   clock_t start = clock();
 
-  // Read and filter the brainfuck program
-  char *text = read_file(argv[1]);
-  char *filtered_text = filter_text(text);
-  free(text); // Free the original unfiltered content
+  // Read the brainfuck program
+  size_t source_length;
+  const char *text = read_file(argv[1], &source_length);
 
-  printf("Program Length: %lu\n", strlen(filtered_text));
+  // Look the program up in the cache, a hit skips filtering and loop preprocessing
+  program_cache_entry cached = {0};
+  char cache_path[4096];
+  program_cache_key source_key;
+  int cache_hit = 0;
+  if (enable_cache) {
+    enable_cache = program_cache_hash(text, source_length, "c", &source_key) == 0 &&
+                   program_cache_path(cache_path, sizeof(cache_path), &source_key, "bfc") == 0;
+    cache_hit = enable_cache && program_cache_load(cache_path, &source_key, source_length, &cached) == 0;
+  }
 
-  // Allocate memory for loop positions
-  int *loop_map = (int *)malloc(strlen(filtered_text) * sizeof(int));
-  if (!loop_map) {
-    fprintf(stderr, "Memory allocation failed\n");
-    exit(1);
+  char *filtered_text = NULL;
+  int *loop_map = NULL;
+  if (!cache_hit) {
+    filtered_text = filter_text(text, source_length);
+
+    // Allocate memory for loop positions
+    loop_map = (int *)calloc(strlen(filtered_text) + 1, sizeof(int));
+    if (!loop_map) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+
+    // Preprocess loop start and end positions
+    preprocess_loops(filtered_text, loop_map);
+
+    if (enable_cache) {
+      program_cache_store(cache_path, &source_key, source_length, filtered_text, strlen(filtered_text), loop_map);
+    }
   }
+  unmap_file(text, source_length); // Release the original unfiltered content
 
-  // Preprocess loop start and end positions
-  preprocess_loops(filtered_text, loop_map);
+  const char *program_text = cache_hit ? cached.text : filtered_text;
+  const int *program_loop_map = cache_hit ? cached.loop_map : loop_map;
+
+  printf("Program Length: %lu\n", strlen(program_text));
 
   // Execute the brainfuck-like program
-  parse_program(filtered_text, loop_map);
+  parse_program(program_text, program_loop_map);
 
   // Record end time
   clock_t end = clock();
   double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
   printf("\nTime taken: %.6f seconds\n", elapsed);
 
+  if (enable_perf_counters) {
+    fflush(stdout);
+    perf_counters_report(&counters);
+    perf_counters_close(&counters);
+  }
+
   // Free allocated memory
   free(filtered_text);
   free(loop_map);
+  program_cache_release(&cached);
 
   return 0;
 }
@@ -1,43 +1,71 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
-#include <stack>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <cstdlib>
 #include <chrono>
 #include <algorithm>
+#include <cmath>
+
+#include "checkpoint.h"
+#include "fuel.h"
+#include "loader.h"
+#include "perf_counters.h"
+#include "phase_timer.h"
+#include "program_cache.h"
 
 using namespace std;
 
 bool enable_profiler = false;
+bool enable_perf_counters = false;
+bool enable_phase_summary = false;
+bool enable_tape_profiler = false;
+bool enable_cache = false;
+string trace_file;
+
+// Checkpointing: snapshot file, back-edges between snapshots (0 for signals only) and snapshot to resume from
+string checkpoint_file;
+unsigned long checkpoint_interval = 0;
+string resume_file;
+
+// Execution budget, charged at back-edges: instruction budget (-1 for none) and time limit in seconds (0 for none)
+bool enable_fuel = false;
+long long fuel_budget = -1;
+double time_limit = 0;
+fuel_meter fuel;
+
+perf_counters counters;
+phase_timer timer;
 
 unordered_map<int, int> instruction_count;
-unordered_map<int, int> loop_map;
+vector<int32_t> loop_map;
 unordered_map<string, int> non_simple_loops;
 unordered_map<string, int> simple_loops;
 
-// Function to open file and read content
-string read_file(const string &file_name) {
-  ifstream file(file_name);
-  if (!file.is_open()) {
+// Number of cells on the tape
+const int tape_size = 30000;
+
+// Tape profiler: flat per-cell access counters and the pointer range reached
+vector<unsigned long long> tape_reads;
+vector<unsigned long long> tape_writes;
+int min_ptr = 0;
+int max_ptr = 0;
+
+// Function to map the file content, release it with unmap_file
+const char *read_file(const string &file_name, size_t &length) {
+  const char *content = map_file(file_name.c_str(), &length);
+  if (!content) {
     cerr << "Error opening file: " << file_name << endl;
     exit(1);
   }
-  string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-  file.close();
   return content;
 }
 
 // Function to filter and return only '+-<>,.[]' characters from the text
-string filter_text(const string &text) {
-  string filtered;
-  filtered.reserve(text.size());
-  for (char ch : text) {
-    if (ch == '+' || ch == '-' || ch == '<' || ch == '>' || ch == ',' || ch == '.' || ch == '[' || ch == ']') {
-      filtered += ch;
-    }
-  }
+string filter_text(const char *text, size_t length) {
+  string filtered(length, '\0');
+  filtered.resize(filter_program(text, length, &filtered[0]));
   return filtered;
 }
 
@@ -50,27 +78,8 @@ void initialize_globals() {
 
 // Preprocessing to match loops and store their positions
 bool preprocess_loops(const string &text) {
-  stack<int> loop_stack;
-
-  for (int i = 0; i < text.size(); i++) {
-    if (text[i] == '[') {
-      loop_stack.push(i);
-    } else if (text[i] == ']') {
-      if (loop_stack.empty()) {
-        cerr << "Mismatched ']' at position " << i << endl;
-        exit(1);
-      }
-      int open_pos = loop_stack.top();
-      loop_map[open_pos] = i;
-      loop_stack.pop();
-      loop_map[i] = open_pos;
-    }
-  }
-
-  if (!loop_stack.empty()) {
-    cerr << "Mismatched '[' at position " << loop_stack.top() << endl;
-    exit(1);
-  }
+  loop_map.assign(text.size(), 0);
+  match_brackets(text.data(), text.size(), loop_map.data());
 
   if(enable_profiler) {
     bool is_inner_most_loop = false;
@@ -114,18 +123,191 @@ bool preprocess_loops(const string &text) {
   return true;
 }
 
-// Function to parse and execute the brainfuck-like program
-void parse_program(const string &text) {
+// Record the tape cell accessed by the command about to be executed. A pointer past the end of
+// the tape grows the tape and the counters, so the run goes on and the report shows how far it got.
+void record_tape_access(char command, int ptr, vector<char> &tape) {
+  min_ptr = min(min_ptr, ptr);
+  max_ptr = max(max_ptr, ptr);
+  if (ptr >= (int)tape_reads.size()) {
+    size_t size = max((size_t)ptr + 1, 2 * tape_reads.size());
+    tape_reads.resize(size, 0);
+    tape_writes.resize(size, 0);
+    tape.resize(max(size, tape.size()), 0);
+  }
+
+  switch (command) {
+    case '+':
+    case '-':
+      tape_reads[ptr]++;
+      tape_writes[ptr]++;
+      break;
+    case '.':
+    case '[':
+    case ']':
+      tape_reads[ptr]++;
+      break;
+    case ',':
+      tape_writes[ptr]++;
+      break;
+    default:
+      break;
+  }
+}
+
+// Print the pointer range, the working set, the hottest runs of cells and a heatmap of the touched range
+void print_tape_profile() {
+  const int heatmap_width = 64;
+  const string shades = " .:-=+*#%@";
+
+  // Cells are one byte each, so every 64 consecutive cells share a cache line
+  int touched = 0;
+  int cache_lines = 0;
+  int last_line = -1;
+  unsigned long long total = 0;
+  for (int i = min_ptr; i <= max_ptr; i++) {
+    if (tape_reads[i] + tape_writes[i] > 0) {
+      touched++;
+      total += tape_reads[i] + tape_writes[i];
+      if (i / 64 != last_line) {
+        cache_lines++;
+        last_line = i / 64;
+      }
+    }
+  }
+  int span = max_ptr - min_ptr + 1;
+
+  cout << "Tape profile:" << endl;
+  cout << "Pointer range: [" << min_ptr << ", " << max_ptr << "] of " << tape_size << " cells" << endl;
+  if (max_ptr >= tape_size) {
+    cout << "Pointer exceeded the tape: reached cell " << max_ptr << ", the program needs " << max_ptr + 1
+         << " cells" << endl;
+  }
+  cout << "Working set: " << touched << " cells touched, " << span << " cells spanned ("
+       << 100.0 * touched / span << "% dense), " << cache_lines << " cache lines" << endl;
+
+  // Hot ranges are maximal runs of touched cells, ranked by their number of accesses
+  vector<pair<pair<int, int>, unsigned long long>> ranges;
+  for (int i = min_ptr; i <= max_ptr; i++) {
+    if (tape_reads[i] + tape_writes[i] == 0) {
+      continue;
+    }
+    if (ranges.empty() || ranges.back().first.second != i - 1) {
+      ranges.push_back({{i, i}, 0});
+    }
+    ranges.back().first.second = i;
+    ranges.back().second += tape_reads[i] + tape_writes[i];
+  }
+  sort(ranges.begin(), ranges.end(), [](const pair<pair<int, int>, unsigned long long> &a,
+                                        const pair<pair<int, int>, unsigned long long> &b) {
+    return a.second > b.second;
+  });
+  cout << "Hot cell ranges:" << endl;
+  for (int i = 0; i < (int)ranges.size() && i < 5; i++) {
+    cout << "  [" << ranges[i].first.first << ", " << ranges[i].first.second << "]: " << ranges[i].second
+         << " accesses (" << 100.0 * ranges[i].second / total << "%)" << endl;
+  }
+
+  // Each heatmap column covers a bucket of cells, shaded by the log of its accesses
+  int bucket_size = (span + heatmap_width - 1) / heatmap_width;
+  vector<unsigned long long> buckets((span + bucket_size - 1) / bucket_size, 0);
+  unsigned long long hottest = 0;
+  for (int i = min_ptr; i <= max_ptr; i++) {
+    unsigned long long &bucket = buckets[(i - min_ptr) / bucket_size];
+    bucket += tape_reads[i] + tape_writes[i];
+    hottest = max(hottest, bucket);
+  }
+  string heatmap;
+  for (unsigned long long bucket : buckets) {
+    if (bucket == 0) {
+      heatmap += shades[0];
+      continue;
+    }
+    double level = hottest > 1 ? log((double)bucket) / log((double)hottest) : 1.0;
+    heatmap += shades[1 + (int)((shades.size() - 2) * level)];
+  }
+  cout << "Heatmap (" << bucket_size << " cells per column, reads + writes):" << endl;
+  cout << "  |" << heatmap << "|" << endl;
+}
+
+// Write a snapshot of the execution state, storing only the range of non-zero cells, and stop
+// the process if the snapshot was asked for with SIGTERM
+void save_checkpoint(uint64_t program_hash, int ip, int ptr, const vector<char> &tape,
+                     uint64_t input_offset, uint64_t output_offset) {
+  int first = 0;
+  int last = tape_size - 1;
+  while (first < tape_size && tape[first] == 0) first++;
+  while (last >= first && tape[last] == 0) last--;
+
+  checkpoint_header header = {};
+  header.program_hash = program_hash;
+  header.ip = ip;
+  header.ptr = ptr;
+  header.tape_size = tape_size;
+  header.tape_start = first < tape_size ? first : 0;
+  header.tape_length = last - first + 1 > 0 ? last - first + 1 : 0;
+  header.input_offset = input_offset;
+  header.output_offset = output_offset;
+  header.output_position = checkpoint_output_position();
+  if (checkpoint_save(checkpoint_file.c_str(), &header,
+                      reinterpret_cast<const unsigned char *>(tape.data()) + header.tape_start) != 0) {
+    cerr << "Error writing checkpoint: " << checkpoint_file << endl;
+  }
+  if (checkpoint_signal == SIGTERM) {
+    exit(128 + SIGTERM);
+  }
+  checkpoint_signal = 0;
+}
+
+// Function to parse and execute the brainfuck-like program, text and loop_map may point into a cache entry
+void parse_program(string_view text, const int32_t *loop_map) {
   int ip = 0;  // instruction pointer
   int ptr = 0; // memory pointer
 
   // Start with a larger tape size to avoid frequent resizing
-  vector<char> tape(30000, 0);
+  vector<char> tape(tape_size, 0);
+
+  // Stream offsets and back-edge count, only used for checkpoints
+  uint64_t program_hash = 0;
+  uint64_t input_offset = 0;
+  uint64_t output_offset = 0;
+  unsigned long back_edges = 0;
+
+  if (!checkpoint_file.empty() || !resume_file.empty()) {
+    program_hash = checkpoint_hash(text.data(), text.size());
+  }
+
+  if (!resume_file.empty()) {
+    checkpoint_header header;
+    size_t mapped_size;
+    const unsigned char *cells = checkpoint_load(resume_file.c_str(), program_hash, tape_size, &header, &mapped_size);
+    if (!cells) {
+      exit(1);
+    }
+    copy(cells, cells + header.tape_length, tape.begin() + header.tape_start);
+    checkpoint_unmap(cells, &header, mapped_size);
+    checkpoint_restore_streams(&header);
+    ip = (int)header.ip;
+    ptr = (int)header.ptr;
+    input_offset = header.input_offset;
+    output_offset = header.output_offset;
+  }
+  if (enable_tape_profiler) {
+    tape_reads.assign(tape_size, 0);
+    tape_writes.assign(tape_size, 0);
+  }
+
+  timer.begin("execute");
+  if (enable_perf_counters) {
+    perf_counters_start(&counters);
+  }
 
   // Process each character in the input program
   while (ip < text.size()) {
     char command = text[ip];
     instruction_count[ip]++;
+    if (enable_tape_profiler) {
+      record_tape_access(command, ptr, tape);
+    }
 
     switch (command) {
       case '>':  // move pointer right
@@ -151,28 +333,52 @@ void parse_program(const string &text) {
 
       case '.':  // output the value at current cell as character
         putchar(tape[ptr]);
+        output_offset++;
         break;
 
       case ',':  // read a character from input into the current cell
-        tape[ptr] = getchar();
+        if (!checkpoint_file.empty()) {
+          // A snapshot signal interrupts a blocked read, snapshot before the ',' and read again
+          int ch;
+          while ((ch = checkpoint_getchar()) == CHECKPOINT_READ_INTERRUPTED) {
+            if (checkpoint_signal) {
+              save_checkpoint(program_hash, ip, ptr, tape, input_offset, output_offset);
+            }
+          }
+          tape[ptr] = ch;
+        } else {
+          tape[ptr] = getchar();
+        }
+        input_offset++;
         break;
 
       case '[':  // begin loop
         if (tape[ptr] == 0) {
-          ip = loop_map.at(ip);  // jump to the matching ']'
+          ip = loop_map[ip];  // jump to the matching ']'
         } else if(enable_profiler) {
-          if(non_simple_loops.find(text.substr(ip, loop_map[ip] - ip + 1)) != non_simple_loops.end()) {
-            non_simple_loops[text.substr(ip, loop_map[ip] - ip + 1)]++;
+          string loop_body(text.substr(ip, loop_map[ip] - ip + 1));
+          if(non_simple_loops.find(loop_body) != non_simple_loops.end()) {
+            non_simple_loops[loop_body]++;
           }
-          if(simple_loops.find(text.substr(ip, loop_map[ip] - ip + 1)) != simple_loops.end()) {
-            simple_loops[text.substr(ip, loop_map[ip] - ip + 1)]++;
+          if(simple_loops.find(loop_body) != simple_loops.end()) {
+            simple_loops[loop_body]++;
           }
         }
         break;
 
       case ']':  // end loop
         if (tape[ptr] != 0) {
-          ip = loop_map.at(ip);  // jump back to the matching '['
+          // Charge one iteration of the loop body against the budget
+          if (enable_fuel && (fuel.remaining -= ip - loop_map[ip]) < 0 && !fuel_refill(&fuel)) {
+            fuel_exhausted_exit();
+          }
+          ip = loop_map[ip];  // jump back to the matching '['
+
+          // Snapshot on the back-edge, resuming continues after the '['
+          if (!checkpoint_file.empty() && (++back_edges == checkpoint_interval || checkpoint_signal)) {
+            save_checkpoint(program_hash, ip + 1, ptr, tape, input_offset, output_offset);
+            back_edges = 0;
+          }
         }
         break;
 
@@ -184,7 +390,21 @@ void parse_program(const string &text) {
     ip++; // move to the next instruction
   }
 
+  // A signal that arrived after the last back-edge is answered with a snapshot of the finished run
+  if (!checkpoint_file.empty()) {
+    if (checkpoint_signal) {
+      save_checkpoint(program_hash, ip, ptr, tape, input_offset, output_offset);
+    }
+    checkpoint_restore_signal_handlers();
+  }
+
+  if (enable_perf_counters) {
+    perf_counters_stop(&counters);
+  }
+  timer.end();
+
   if(enable_profiler) {
+    timer.begin("profile report");
     // Print instruction count
     cout << "Instruction counts:" << endl;
     for (auto &pair : instruction_count) {
@@ -220,6 +440,13 @@ void parse_program(const string &text) {
     for (auto &pair : non_simple_loops_vec) {
       cout << pair.first << ": " << pair.second << endl;
     }
+    timer.end();
+  }
+
+  if (enable_tape_profiler) {
+    timer.begin("tape profile report");
+    print_tape_profile();
+    timer.end();
   }
 }
 
@@ -230,30 +457,120 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  // Check for flag "-p" to enable profiler
-  if (argc == 3 && string(argv[2]) == "-p") {
-    enable_profiler = true;
+  // Check for flag "-p" to enable profiler, "--cache" to reuse the preprocessed program from the program cache
+  // (ignored with "-p", whose loop analysis runs during preprocessing), "--tape-profile" to profile tape accesses,
+  // "--perf-counters" to read hardware counters, "--phases" to print the phase timings
+  // and "--trace <file>" to write them as a Chrome trace. "--checkpoint <file>" and "--checkpoint-every <N>"
+  // snapshot the execution on SIGUSR1/SIGTERM or every N back-edges, "--resume <file>" continues from a snapshot.
+  // "--fuel <N>" and "--time-limit <seconds>" stop the execution once it has used up its budget
+  for (int i = 2; i < argc; i++) {
+    if (string(argv[i]) == "-p") {
+      enable_profiler = true;
+    } else if (string(argv[i]) == "--cache") {
+      enable_cache = true;
+    } else if (string(argv[i]) == "--tape-profile") {
+      enable_tape_profiler = true;
+    } else if (string(argv[i]) == "--perf-counters") {
+      enable_perf_counters = true;
+    } else if (string(argv[i]) == "--phases") {
+      enable_phase_summary = true;
+    } else if (string(argv[i]) == "--trace" && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (string(argv[i]) == "--checkpoint" && i + 1 < argc) {
+      checkpoint_file = argv[++i];
+    } else if (string(argv[i]) == "--checkpoint-every" && i + 1 < argc) {
+      checkpoint_interval = strtoul(argv[++i], nullptr, 10);
+    } else if (string(argv[i]) == "--resume" && i + 1 < argc) {
+      resume_file = argv[++i];
+    } else if (string(argv[i]) == "--fuel" && i + 1 < argc) {
+      enable_fuel = true;
+      fuel_budget = strtoll(argv[++i], nullptr, 10);
+    } else if (string(argv[i]) == "--time-limit" && i + 1 < argc) {
+      enable_fuel = true;
+      time_limit = strtod(argv[++i], nullptr);
+    }
+  }
+  if (enable_fuel) {
+    fuel_init(&fuel, fuel_budget, time_limit);
+  }
+  if (!checkpoint_file.empty()) {
+    checkpoint_install_signal_handlers();
+  }
+  if (enable_perf_counters) {
+    perf_counters_open(&counters);
   }
 
   // Record time
   const auto start = chrono::high_resolution_clock::now();
 
-  string text = read_file(argv[1]);
-  text = filter_text(text); // filter out non-instruction characters
-//  cout << "Program Length: " << text.size() << endl;
+  timer.begin("load");
+  size_t source_length;
+  const char *source = read_file(argv[1], source_length);
+  timer.end();
 
   initialize_globals();
 
-  // Preprocess loop start and end positions
-  preprocess_loops(text);
+  // Look the program up in the cache, a hit is executed straight from the mapping
+  program_cache_entry cached = {};
+  program_cache_key cache_key;
+  char cache_path[4096];
+  bool use_cache = enable_cache && !enable_profiler;
+  timer.begin("cache lookup");
+  use_cache = use_cache && program_cache_hash(source, source_length, "cpp", &cache_key) == 0 &&
+              program_cache_path(cache_path, sizeof(cache_path), &cache_key, "bfc") == 0;
+  bool cache_hit = use_cache && program_cache_load(cache_path, &cache_key, source_length, &cached) == 0;
+  timer.end();
+
+  string text;
+
+  if (!cache_hit) {
+    timer.begin("filter");
+    text = filter_text(source, source_length); // filter out non-instruction characters
+    timer.end();
+//    cout << "Program Length: " << text.size() << endl;
+
+    // Preprocess loop start and end positions
+    timer.begin("bracket match");
+    preprocess_loops(text);
+    timer.end();
+
+    if (use_cache) {
+      timer.begin("cache store");
+      program_cache_store(cache_path, &cache_key, source_length, text.data(), text.size(), loop_map.data());
+      timer.end();
+    }
+  }
+  unmap_file(source, source_length); // Release the original unfiltered content
 
   // Execute the brainfuck program
-  parse_program(text);
+  if (cache_hit) {
+    parse_program(string_view(cached.text, cached.length), cached.loop_map);
+  } else {
+    parse_program(text, loop_map.data());
+  }
+  program_cache_release(&cached);
+
+  timer.begin("flush");
+  fflush(stdout);
+  timer.end();
 
   // Record time
   const auto end = chrono::high_resolution_clock::now();
   chrono::duration<double> elapsed = end - start;
   cout << "\nTime taken: " << elapsed.count() << " seconds" << endl;
 
+  if (enable_perf_counters) {
+    perf_counters_report(&counters);
+    perf_counters_close(&counters);
+  }
+
+  if (enable_phase_summary) {
+    timer.print_summary(cerr);
+  }
+  if (!trace_file.empty() && !timer.write_trace(trace_file, argv[0])) {
+    cerr << "Error writing trace file: " << trace_file << endl;
+    return 1;
+  }
+
   return 0;
 }
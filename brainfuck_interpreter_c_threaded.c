@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include "fuel.h"
+#include "perf_counters.h"
+
 // Define the size of the tape
 #define TAPE_SIZE 30000
 
@@ -27,6 +31,16 @@ void bf_jump_backward(void);
 // Command array: Maps characters to corresponding functions
 bf_command_fn command_map[256];
 
+// Hardware counters read around the interpreter loop with "--perf-counters"
+int enable_perf_counters = 0;
+perf_counters counters;
+
+// Execution budget, charged at back-edges: instruction budget (-1 for none) and time limit in seconds (0 for none)
+int enable_fuel = 0;
+long long fuel_budget = -1;
+double time_limit = 0;
+fuel_meter fuel;
+
 void bf_increment_ptr(void) {
   ptr++;
   if (ptr >= TAPE_SIZE) {
@@ -71,12 +85,18 @@ void bf_jump_forward(void) {
 
 void bf_jump_backward(void) {
   if (tape[ptr] != 0) {
+    unsigned int loop_end = ip;
     int loop = 1;
     while (loop > 0) {
       ip--;
       if (program[ip] == '[') loop--;
       if (program[ip] == ']') loop++;
     }
+
+    // Charge one iteration of the loop body against the budget
+    if (enable_fuel && (fuel.remaining -= loop_end - ip) < 0 && !fuel_refill(&fuel)) {
+      fuel_exhausted_exit();
+    }
   }
 }
 
@@ -96,6 +116,10 @@ void setup_command_map() {
 void interpret(const char *bf_program) {
   program = bf_program;
 
+  if (enable_perf_counters) {
+    perf_counters_start(&counters);
+  }
+
   // Loop over the Brainfuck program
   while (program[ip] != '\0') {
     bf_command_fn command = command_map[(unsigned char)program[ip]];
@@ -107,6 +131,10 @@ void interpret(const char *bf_program) {
 
     ip++;  // Move to the next instruction
   }
+
+  if (enable_perf_counters) {
+    perf_counters_stop(&counters);
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -115,6 +143,26 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // Check for flag "--perf-counters" to read hardware counters around the execution, and "--fuel <N>"
+  // and "--time-limit <seconds>" to stop the execution once it has used up its budget
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--perf-counters") == 0) {
+      enable_perf_counters = 1;
+    } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+      enable_fuel = 1;
+      fuel_budget = strtoll(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+      enable_fuel = 1;
+      time_limit = strtod(argv[++i], NULL);
+    }
+  }
+  if (enable_fuel) {
+    fuel_init(&fuel, fuel_budget, time_limit);
+  }
+  if (enable_perf_counters) {
+    perf_counters_open(&counters);
+  }
+
   // Record start time
   clock_t start = clock();
 
@@ -157,5 +205,11 @@ int main(int argc, char *argv[]) {
   clock_t end = clock();
   double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
   printf("\nTime taken: %.6f seconds\n", elapsed);
+
+  if (enable_perf_counters) {
+    fflush(stdout);
+    perf_counters_report(&counters);
+    perf_counters_close(&counters);
+  }
   return 0;
 }
@@ -0,0 +1,376 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <string>
+#include <cstring>
+#include <csignal>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "loader.h"
+
+using namespace std;
+
+// Serves one brainfuck program to many interactive sessions from a single thread.
+// Every client connecting to the Unix socket gets its own execution of the program: what the
+// client sends is the program's input and the program's output is sent back. Executions are
+// resumable state machines, so a ',' with no input available suspends the session instead of
+// blocking, and long-running sessions are suspended every few back-edges to stay fair.
+
+const int tape_size = 30000;
+
+// Back-edges a session may run before it yields to the other sessions
+long slice_back_edges = 10000;
+
+// Output is handed back to the client in batches of up to this many bytes
+const size_t output_batch_size = 64 * 1024;
+
+string text;            // filtered program
+vector<int32_t> loop_map; // matching bracket position for every '[' and ']'
+
+enum run_status {
+  RUN_FINISHED,    // reached the end of the program
+  RUN_NEEDS_INPUT, // suspended on ',' until the client sends more input
+  RUN_YIELDED,     // suspended after its slice or with a full output batch
+  RUN_FAILED       // pointer moved off the tape
+};
+
+// Everything needed to resume an execution
+struct session {
+  int fd;
+  size_t ip = 0;
+  int ptr = 0;
+  vector<unsigned char> tape = vector<unsigned char>(tape_size, 0);
+  string input;
+  size_t input_pos = 0;
+  bool input_closed = false;
+  string output;
+  size_t output_pos = 0;
+  bool finished = false;
+  bool queued = false;
+};
+
+unordered_map<int, session> sessions;
+deque<int> ready_queue;
+int epoll_fd;
+
+// Function to map the file content, release it with unmap_file
+const char *read_file(const string &file_name, size_t &length) {
+  const char *content = map_file(file_name.c_str(), &length);
+  if (!content) {
+    cerr << "Error opening file: " << file_name << endl;
+    exit(1);
+  }
+  return content;
+}
+
+// Function to filter and return only '+-<>,.[]' characters from the text
+string filter_text(const char *text, size_t length) {
+  string filtered(length, '\0');
+  filtered.resize(filter_program(text, length, &filtered[0]));
+  return filtered;
+}
+
+// Preprocessing to match loops and store their positions
+void preprocess_loops(const string &text) {
+  loop_map.assign(text.size(), 0);
+  match_brackets(text.data(), text.size(), loop_map.data());
+}
+
+// Run a session until it finishes or has to be suspended. All state lives in the session,
+// so calling it again continues exactly where it stopped.
+run_status run_session(session &s) {
+  long back_edges = 0;
+
+  while (s.ip < text.size()) {
+    switch (text[s.ip]) {
+      case '>':  // move pointer right
+        if (++s.ptr >= tape_size) {
+          return RUN_FAILED;
+        }
+        break;
+
+      case '<':  // move pointer left
+        if (--s.ptr < 0) {
+          return RUN_FAILED;
+        }
+        break;
+
+      case '+':  // increment the value at current cell
+        s.tape[s.ptr]++;
+        break;
+
+      case '-':  // decrement the value at current cell
+        s.tape[s.ptr]--;
+        break;
+
+      case '.':  // output the value at current cell as character
+        s.output += (char)s.tape[s.ptr];
+        if (s.output.size() - s.output_pos >= output_batch_size) {
+          s.ip++;
+          return RUN_YIELDED;
+        }
+        break;
+
+      case ',':  // read a character from input, suspend until the client sends one
+        if (s.input_pos < s.input.size()) {
+          s.tape[s.ptr] = s.input[s.input_pos++];
+        } else if (s.input_closed) {
+          s.tape[s.ptr] = (unsigned char)EOF;
+        } else {
+          return RUN_NEEDS_INPUT;
+        }
+        break;
+
+      case '[':  // begin loop
+        if (s.tape[s.ptr] == 0) {
+          s.ip = loop_map[s.ip];  // jump to the matching ']'
+        }
+        break;
+
+      case ']':  // end loop
+        if (s.tape[s.ptr] != 0) {
+          s.ip = loop_map[s.ip];  // jump back to the matching '['
+          if (++back_edges == slice_back_edges) {
+            s.ip++;
+            return RUN_YIELDED;
+          }
+        }
+        break;
+
+      default:
+        break;
+    }
+    s.ip++; // move to the next instruction
+  }
+  return RUN_FINISHED;
+}
+
+void close_session(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  sessions.erase(fd);
+}
+
+void schedule(session &s) {
+  if (!s.queued) {
+    s.queued = true;
+    ready_queue.push_back(s.fd);
+  }
+}
+
+// Watch for input until the client closes its side, and for writability while output is pending
+void update_events(session &s) {
+  uint32_t events = 0;
+  if (!s.input_closed) {
+    events |= EPOLLIN;
+  }
+  if (!s.output.empty()) {
+    events |= EPOLLOUT;
+  }
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = s.fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s.fd, &event);
+}
+
+// Write as much pending output as the socket takes. Returns false if the session was closed.
+bool flush_output(session &s) {
+  while (s.output_pos < s.output.size()) {
+    ssize_t written = write(s.fd, s.output.data() + s.output_pos, s.output.size() - s.output_pos);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      close_session(s.fd);
+      return false;
+    }
+    s.output_pos += written;
+  }
+  if (s.output_pos == s.output.size()) {
+    s.output.clear();
+    s.output_pos = 0;
+  }
+
+  // Wait for the socket to drain before producing more output
+  update_events(s);
+
+  if (s.finished && s.output.empty()) {
+    close_session(s.fd);
+    return false;
+  }
+  return true;
+}
+
+void accept_sessions(int listen_fd) {
+  while (true) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    session &s = sessions[fd];
+    s.fd = fd;
+    schedule(s);
+  }
+}
+
+// New input from the client, or the client closed its side
+void read_input(session &s) {
+  char buffer[4096];
+  while (true) {
+    ssize_t count = read(s.fd, buffer, sizeof(buffer));
+    if (count > 0) {
+      // Drop input the program has already consumed before appending
+      if (s.input_pos == s.input.size()) {
+        s.input.clear();
+        s.input_pos = 0;
+      }
+      s.input.append(buffer, count);
+    } else if (count == 0) {
+      s.input_closed = true;
+      update_events(s);
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      close_session(s.fd);
+      return;
+    }
+  }
+  if (!s.finished) {
+    schedule(s);
+  }
+}
+
+// Run one slice of the session at the head of the ready queue and hand its output back
+void run_next_session() {
+  int fd = ready_queue.front();
+  ready_queue.pop_front();
+  auto found = sessions.find(fd);
+  if (found == sessions.end()) {
+    return;
+  }
+  session &s = found->second;
+  s.queued = false;
+
+  // Sessions with undelivered output wait for EPOLLOUT instead of running
+  if (!s.output.empty()) {
+    return;
+  }
+
+  switch (run_session(s)) {
+    case RUN_FINISHED:
+      s.finished = true;
+      break;
+    case RUN_FAILED:
+      s.output += "\nptr out of tape bounds\n";
+      s.finished = true;
+      break;
+    case RUN_NEEDS_INPUT:
+      // Woken up by read_input
+      break;
+    case RUN_YIELDED:
+      schedule(s);
+      break;
+  }
+  flush_output(s);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " <file_name> <socket_path> [--slice <back-edges>]" << endl;
+    return 1;
+  }
+
+  // Check for flag "--slice" to set the number of back-edges a session runs before yielding
+  for (int i = 3; i < argc; i++) {
+    if (string(argv[i]) == "--slice" && i + 1 < argc) {
+      slice_back_edges = max(1L, strtol(argv[++i], nullptr, 10));
+    }
+  }
+
+  size_t source_length;
+  const char *source = read_file(argv[1], source_length);
+  text = filter_text(source, source_length);
+  unmap_file(source, source_length);
+  preprocess_loops(text);
+
+  // Clients that disconnect early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (strlen(argv[2]) >= sizeof(address.sun_path)) {
+    cerr << "Socket path too long: " << argv[2] << endl;
+    return 1;
+  }
+  strcpy(address.sun_path, argv[2]);
+  unlink(argv[2]);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+    cerr << "Error listening on " << argv[2] << ": " << strerror(errno) << endl;
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event listen_event = {};
+  listen_event.events = EPOLLIN;
+  listen_event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event);
+
+  cout << "Serving " << argv[1] << " on " << argv[2] << endl;
+
+  vector<epoll_event> events(256);
+  while (true) {
+    // Only block when no session is ready to run
+    int count = epoll_wait(epoll_fd, events.data(), (int)events.size(), ready_queue.empty() ? -1 : 0);
+    if (count < 0 && errno != EINTR) {
+      cerr << "epoll_wait failed: " << strerror(errno) << endl;
+      return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        accept_sessions(listen_fd);
+        continue;
+      }
+      auto found = sessions.find(fd);
+      if (found == sessions.end()) {
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        read_input(found->second);
+        found = sessions.find(fd);
+      }
+      if (found != sessions.end() && (events[i].events & EPOLLOUT)) {
+        session &s = found->second;
+        if (flush_output(s) && s.output.empty() && !s.finished) {
+          schedule(s);
+        }
+      }
+    }
+
+    // Give every ready session one slice
+    for (size_t ready = ready_queue.size(); ready > 0 && !ready_queue.empty(); ready--) {
+      run_next_session();
+    }
+  }
+}
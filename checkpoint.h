@@ -0,0 +1,197 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// Snapshots of a running program that can be resumed with identical results.
+// Shared by the C and C++ interpreters, which take a snapshot at loop back-edges, either
+// every N back-edges or when the process receives SIGUSR1 (snapshot and continue) or
+// SIGTERM (snapshot and exit). Signals are also acted on at ',' (a blocked read is
+// interrupted) and when the program ends, so SIGTERM always stops the process.
+//
+// File layout: a fixed-size header followed, at the page-aligned offset tape_offset, by the
+// raw bytes of the cells [tape_start, tape_start + tape_length). Cells outside that range are
+// zero. Resuming maps the file and copies the tape bytes straight out of the mapping.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "BFCKPT1"
+#define CHECKPOINT_PAGE_SIZE 4096
+
+typedef struct {
+  char magic[8];
+  uint64_t program_hash;   // FNV-1a hash of the filtered program text
+  uint64_t ip;             // index of the next instruction to execute
+  uint64_t ptr;            // data pointer
+  uint64_t tape_size;      // number of cells of the engine's tape
+  uint64_t tape_start;     // first cell stored in the snapshot
+  uint64_t tape_length;    // number of cells stored in the snapshot
+  uint64_t input_offset;   // bytes consumed from stdin
+  uint64_t output_offset;  // bytes written to stdout by the program
+  int64_t output_position; // file position of stdout, -1 if stdout is not a regular file
+  uint64_t tape_offset;    // file offset of the stored cells
+} checkpoint_header;
+
+// Set by the signal handlers, polled at back-edges
+static volatile sig_atomic_t checkpoint_signal = 0;
+
+static void checkpoint_signal_handler(int signal_number) {
+  checkpoint_signal = signal_number;
+}
+
+// SIGTERM does not restart system calls, so a read blocked on stdin returns and the snapshot is
+// taken straight away. SIGUSR1 keeps the program running and restarts them, because stdio drops
+// buffered output when a write to a full pipe is interrupted.
+static inline void checkpoint_install_signal_handlers(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = checkpoint_signal_handler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = 0;
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+// Once the program has ended there is nothing left to snapshot
+static inline void checkpoint_restore_signal_handlers(void) {
+  signal(SIGUSR1, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+}
+
+// Value returned by checkpoint_getchar when a snapshot signal interrupted the read
+#define CHECKPOINT_READ_INTERRUPTED (EOF - 1)
+
+// getchar() for ',' that returns CHECKPOINT_READ_INTERRUPTED instead of a character when a
+// snapshot signal is pending or arrives while the read is blocked, so the caller can snapshot
+// with the ',' not yet executed and read again
+static inline int checkpoint_getchar(void) {
+  if (checkpoint_signal) {
+    return CHECKPOINT_READ_INTERRUPTED;
+  }
+  int ch = getchar();
+  if (ch == EOF && ferror(stdin) && errno == EINTR) {
+    clearerr(stdin);
+    return CHECKPOINT_READ_INTERRUPTED;
+  }
+  return ch;
+}
+
+static inline uint64_t checkpoint_hash(const char *text, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Size of the file stdout writes to after flushing it, -1 if stdout is not a regular file.
+// The size rather than the offset, because a resumed run opened with >> (O_APPEND) starts at offset 0.
+static inline int64_t checkpoint_output_position(void) {
+  struct stat st;
+  fflush(stdout);
+  if (fstat(STDOUT_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return (int64_t)st.st_size;
+}
+
+// Write the header and cells to a temporary file and rename it over file_name, so an
+// interrupted write never destroys the previous snapshot. Returns 0 on success.
+static inline int checkpoint_save(const char *file_name, checkpoint_header *header, const unsigned char *cells) {
+  char temp_name[4096];
+  if (snprintf(temp_name, sizeof(temp_name), "%s.tmp", file_name) >= (int)sizeof(temp_name)) {
+    return -1;
+  }
+
+  memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+  header->tape_offset = CHECKPOINT_PAGE_SIZE;
+
+  FILE *file = fopen(temp_name, "wb");
+  if (!file) {
+    return -1;
+  }
+  int ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+           fseek(file, (long)header->tape_offset, SEEK_SET) == 0 &&
+           fwrite(cells, 1, header->tape_length, file) == header->tape_length;
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(temp_name, file_name) != 0) {
+    remove(temp_name);
+    return -1;
+  }
+  return 0;
+}
+
+// Map a snapshot, validate it against the program and tape size and return a pointer to its
+// cells, or NULL with a message on stderr. Release the mapping with checkpoint_unmap.
+static inline const unsigned char *checkpoint_load(const char *file_name, uint64_t program_hash, uint64_t tape_size,
+                                                   checkpoint_header *header, size_t *mapped_size) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening checkpoint: %s\n", file_name);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header)) {
+    fprintf(stderr, "Invalid checkpoint: %s\n", file_name);
+    close(fd);
+    return NULL;
+  }
+  void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Error mapping checkpoint: %s\n", file_name);
+    return NULL;
+  }
+
+  memcpy(header, mapping, sizeof(*header));
+  const char *error = NULL;
+  if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+    error = "not a checkpoint file";
+  } else if (header->program_hash != program_hash) {
+    error = "checkpoint was taken from a different program";
+  } else if (header->tape_size != tape_size || header->ptr >= tape_size ||
+             header->tape_start + header->tape_length > tape_size) {
+    error = "checkpoint tape does not fit this engine";
+  } else if (header->tape_length > 0 && header->tape_offset + header->tape_length > (uint64_t)st.st_size) {
+    error = "checkpoint is truncated";
+  }
+  if (error) {
+    fprintf(stderr, "Invalid checkpoint %s: %s\n", file_name, error);
+    munmap(mapping, (size_t)st.st_size);
+    return NULL;
+  }
+
+  *mapped_size = (size_t)st.st_size;
+  return (const unsigned char *)mapping + header->tape_offset;
+}
+
+static inline void checkpoint_unmap(const unsigned char *cells, const checkpoint_header *header, size_t mapped_size) {
+  munmap((void *)(cells - header->tape_offset), mapped_size);
+}
+
+// Put stdin and stdout back where they were when the snapshot was taken: skip the input that
+// was already consumed and, when both runs write to the same regular file (resume with >>),
+// drop anything written after the snapshot
+static inline void checkpoint_restore_streams(const checkpoint_header *header) {
+  if (lseek(STDIN_FILENO, (off_t)header->input_offset, SEEK_SET) < 0) {
+    for (uint64_t i = 0; i < header->input_offset && getchar() != EOF; i++) {
+    }
+  }
+
+  if (header->output_position >= 0 && checkpoint_output_position() >= header->output_position) {
+    if (ftruncate(STDOUT_FILENO, (off_t)header->output_position) == 0) {
+      // Without O_APPEND the next write must land at the truncation point, not at the old offset
+      lseek(STDOUT_FILENO, (off_t)header->output_position, SEEK_SET);
+    }
+  }
+}
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,65 @@
+#ifndef FUEL_H
+#define FUEL_H
+
+// Execution budgets for untrusted programs, shared by the interpreters.
+// Fuel is only charged at loop back-edges: every iteration costs the length of the loop body,
+// so straight-line code is free and the hot path is one subtraction and one branch. The
+// instruction budget and the time limit are handed to the hot path in slices; the clock is
+// only read when a slice runs out. The compiler emits the same charge inline (see --fuel).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Exit status of a run stopped by its budget, the same as timeout(1)
+#define FUEL_EXHAUSTED_STATUS 124
+#define FUEL_SLICE (1LL << 24)
+
+typedef struct {
+  int64_t remaining;   // fuel left in the current slice, decremented at back-edges
+  int64_t budget_left; // instruction budget not yet handed out, -1 for no instruction budget
+  double deadline;     // CLOCK_MONOTONIC deadline in seconds, 0 for no time limit
+} fuel_meter;
+
+static inline double fuel_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// budget < 0 means no instruction budget, time_limit <= 0 means no time limit
+static inline void fuel_init(fuel_meter *fuel, int64_t budget, double time_limit) {
+  fuel->remaining = 0;
+  fuel->budget_left = budget;
+  fuel->deadline = time_limit > 0 ? fuel_now() + time_limit : 0;
+}
+
+// Slow path, called when the current slice is used up. Returns 0 once the budget or the time
+// limit is exhausted, otherwise starts a new slice and returns 1.
+static inline int fuel_refill(fuel_meter *fuel) {
+  if (fuel->deadline > 0 && fuel_now() >= fuel->deadline) {
+    return 0;
+  }
+  int64_t slice = FUEL_SLICE;
+  if (fuel->budget_left >= 0) {
+    // Whatever the last slice overdrew is paid out of the budget
+    fuel->budget_left += fuel->remaining;
+    if (fuel->budget_left <= 0) {
+      return 0;
+    }
+    slice = fuel->budget_left < slice ? fuel->budget_left : slice;
+    fuel->budget_left -= slice;
+  }
+  fuel->remaining = slice;
+  return 1;
+}
+
+// Stop the run with the partial output flushed
+static inline void fuel_exhausted_exit(void) {
+  fflush(stdout);
+  fprintf(stderr, "\nExecution stopped: budget exhausted\n");
+  exit(FUEL_EXHAUSTED_STATUS);
+}
+
+#endif // FUEL_H
@@ -0,0 +1,226 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+// Loading of program sources, shared by the interpreters and the compiler.
+// The source is mapped and populated instead of copied through a stream, filtered with a SIMD
+// byte-class kernel (AVX2 when the compiler targets it, SSE2 on any x86-64, plain compares
+// otherwise), and brackets are matched with a growable stack into a flat array, so
+// machine-generated programs of hundreds of megabytes load at close to memory bandwidth.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Pipes, FIFOs and process substitutions have no size to map, so they are read into an anonymous
+// mapping instead, which unmap_file releases the same way as a file mapping
+static inline const char *read_stream(int fd, size_t *length) {
+  size_t capacity = 1 << 16;
+  size_t used = 0;
+  char *buffer = (char *)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    return NULL;
+  }
+
+  while (1) {
+    if (used == capacity) {
+      char *grown = (char *)mmap(NULL, capacity * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (grown == MAP_FAILED) {
+        munmap(buffer, capacity);
+        return NULL;
+      }
+      memcpy(grown, buffer, used);
+      munmap(buffer, capacity);
+      buffer = grown;
+      capacity *= 2;
+    }
+    ssize_t count = read(fd, buffer + used, capacity - used);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      munmap(buffer, capacity);
+      return NULL;
+    }
+    if (count == 0) {
+      break;
+    }
+    used += (size_t)count;
+  }
+
+  // Give back the pages past the content, so unmapping length bytes releases everything
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t kept = (used + page_size - 1) / page_size * page_size;
+  if (kept < capacity) {
+    munmap(buffer + kept, capacity - kept);
+  }
+  *length = used;
+  if (used == 0) {
+    return "";
+  }
+  return buffer;
+}
+
+// Map a whole file read-only, or read it if it is not a regular file. Returns NULL on error; an
+// empty file maps to a non-NULL empty buffer.
+static inline const char *map_file(const char *file_name, size_t *length) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    const char *content = read_stream(fd, length);
+    close(fd);
+    return content;
+  }
+  *length = (size_t)st.st_size;
+  if (*length == 0) {
+    close(fd);
+    return "";
+  }
+  // The pages are read in here rather than faulted in by the first pass over the source, so the
+  // I/O is charged to loading and the later phases only measure their own work
+  void *mapping = mmap(NULL, *length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(mapping, *length, MADV_SEQUENTIAL);
+  return (const char *)mapping;
+}
+
+static inline void unmap_file(const char *mapping, size_t length) {
+  if (length > 0) {
+    munmap((void *)mapping, length);
+  }
+}
+
+static inline int is_instruction(char ch) {
+  return ch == '+' || ch == '-' || ch == '<' || ch == '>' || ch == ',' || ch == '.' || ch == '[' || ch == ']';
+}
+
+// Copy the '+-<>,.[]' characters of source into filtered, which must hold length bytes.
+// Returns the number of characters copied.
+static inline size_t filter_program(const char *source, size_t length, char *filtered) {
+  size_t i = 0;
+  size_t j = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#if defined(__AVX2__)
+  typedef __m256i chunk_t;
+#define LOADER_CHUNK 32
+#define LOADER_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define LOADER_SET1(c) _mm256_set1_epi8(c)
+#define LOADER_EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define LOADER_OR(a, b) _mm256_or_si256(a, b)
+#define LOADER_MASK(v) (uint32_t) _mm256_movemask_epi8(v)
+#define LOADER_ALL 0xFFFFFFFFu
+#else
+  typedef __m128i chunk_t;
+#define LOADER_CHUNK 16
+#define LOADER_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOADER_SET1(c) _mm_set1_epi8(c)
+#define LOADER_EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define LOADER_OR(a, b) _mm_or_si128(a, b)
+#define LOADER_MASK(v) (uint32_t) _mm_movemask_epi8(v)
+#define LOADER_ALL 0xFFFFu
+#endif
+  const chunk_t plus = LOADER_SET1('+'), minus = LOADER_SET1('-');
+  const chunk_t left = LOADER_SET1('<'), right = LOADER_SET1('>');
+  const chunk_t comma = LOADER_SET1(','), dot = LOADER_SET1('.');
+  const chunk_t open_bracket = LOADER_SET1('['), close_bracket = LOADER_SET1(']');
+
+  for (; i + LOADER_CHUNK <= length; i += LOADER_CHUNK) {
+    chunk_t bytes = LOADER_LOAD(source + i);
+    chunk_t matches = LOADER_OR(LOADER_OR(LOADER_OR(LOADER_EQ(bytes, plus), LOADER_EQ(bytes, minus)),
+                                          LOADER_OR(LOADER_EQ(bytes, left), LOADER_EQ(bytes, right))),
+                                LOADER_OR(LOADER_OR(LOADER_EQ(bytes, comma), LOADER_EQ(bytes, dot)),
+                                          LOADER_OR(LOADER_EQ(bytes, open_bracket), LOADER_EQ(bytes, close_bracket))));
+    uint32_t mask = LOADER_MASK(matches);
+
+    // Dense chunks (typical of generated code) are copied whole, others one set bit at a time
+    if (mask == LOADER_ALL) {
+      memcpy(filtered + j, source + i, LOADER_CHUNK);
+      j += LOADER_CHUNK;
+    } else {
+      while (mask) {
+        filtered[j++] = source[i + __builtin_ctz(mask)];
+        mask &= mask - 1;
+      }
+    }
+  }
+#undef LOADER_CHUNK
+#undef LOADER_LOAD
+#undef LOADER_SET1
+#undef LOADER_EQ
+#undef LOADER_OR
+#undef LOADER_MASK
+#undef LOADER_ALL
+#endif
+
+  for (; i < length; i++) {
+    if (is_instruction(source[i])) {
+      filtered[j++] = source[i];
+    }
+  }
+  return j;
+}
+
+// Match brackets into loop_map, which must hold length entries: every '[' gets the position of
+// its ']' and the other way round. Mismatched brackets are reported and end the process.
+static inline void match_brackets(const char *text, size_t length, int32_t *loop_map) {
+  size_t capacity = 1024;
+  size_t depth = 0;
+  int32_t *loop_stack = (int32_t *)malloc(capacity * sizeof(int32_t));
+  if (!loop_stack) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    if (text[i] == '[') {
+      if (depth == capacity) {
+        capacity *= 2;
+        int32_t *grown = (int32_t *)realloc(loop_stack, capacity * sizeof(int32_t));
+        if (!grown) {
+          fprintf(stderr, "Memory allocation failed\n");
+          exit(1);
+        }
+        loop_stack = grown;
+      }
+      loop_stack[depth++] = (int32_t)i;
+    } else if (text[i] == ']') {
+      if (depth == 0) {
+        fprintf(stderr, "Mismatched ']' at position %zu\n", i);
+        exit(1);
+      }
+      int32_t open_pos = loop_stack[--depth];
+      loop_map[open_pos] = (int32_t)i;
+      loop_map[i] = open_pos;
+    }
+  }
+
+  if (depth > 0) {
+    fprintf(stderr, "Mismatched '[' at position %d\n", loop_stack[depth - 1]);
+    exit(1);
+  }
+  free(loop_stack);
+}
+
+#endif // LOADER_H
@@ -0,0 +1,177 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+// Hardware performance counters around a region of code, read with Linux perf_event_open.
+// Shared by the C and C++ interpreters. Counters the kernel refuses to open (containers,
+// perf_event_paranoid, missing PMU) are reported as unavailable instead of failing the run.
+// The counters form one group, so they are scheduled onto the PMU together and every ratio
+// compares counts from the same time window. If the kernel has to multiplex the group, the
+// counts are scaled up by enabled/running time and the report says so.
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCHES,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_COUNTER_COUNT
+};
+
+typedef struct {
+  int fds[PERF_COUNTER_COUNT];
+  int leader;                                    // counter whose fd controls the group, -1 if none opened
+  unsigned long long values[PERF_COUNTER_COUNT]; // scaled to the whole enabled time
+  unsigned long long time_enabled;               // nanoseconds the group was enabled
+  unsigned long long time_running;               // nanoseconds the group was on the PMU
+} perf_counters;
+
+static const char *perf_counter_names[PERF_COUNTER_COUNT] = {
+  "cycles", "instructions", "branches", "branch-misses", "L1D-read-misses"
+};
+
+// Open every counter in one group led by the first counter that opens, disabled, counting user
+// space of the calling thread only
+static inline void perf_counters_open(perf_counters *counters) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    counters->fds[i] = -1;
+    counters->values[i] = 0;
+  }
+  counters->leader = -1;
+  counters->time_enabled = 0;
+  counters->time_running = 0;
+#ifdef __linux__
+  static const unsigned long long configs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+  };
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = (i == PERF_L1D_MISSES) ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // Only the leader starts disabled, the members follow it
+    attr.disabled = counters->leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int group_fd = counters->leader < 0 ? -1 : counters->fds[counters->leader];
+    counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    if (counters->fds[i] >= 0 && counters->leader < 0) {
+      counters->leader = i;
+    }
+  }
+#endif
+}
+
+static inline void perf_counters_start(perf_counters *counters) {
+#ifdef __linux__
+  if (counters->leader >= 0) {
+    ioctl(counters->fds[counters->leader], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counters->fds[counters->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#else
+  (void)counters;
+#endif
+}
+
+static inline void perf_counters_close(perf_counters *counters);
+
+// Stop the group and read all counters at once. The group read is laid out as the number of
+// counters, the enabled and running times, then one value per counter in the order they were opened.
+static inline void perf_counters_stop(perf_counters *counters) {
+#ifdef __linux__
+  if (counters->leader < 0) {
+    return;
+  }
+  int leader_fd = counters->fds[counters->leader];
+  ioctl(leader_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  unsigned long long group[3 + PERF_COUNTER_COUNT];
+  ssize_t length = read(leader_fd, group, sizeof(group));
+  if (length < (ssize_t)(3 * sizeof(group[0])) || length != (ssize_t)((3 + group[0]) * sizeof(group[0]))) {
+    perf_counters_close(counters);
+    return;
+  }
+  counters->time_enabled = group[1];
+  counters->time_running = group[2];
+
+  unsigned long long member = 0;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counters->fds[i] >= 0 && member < group[0]) {
+      unsigned long long value = group[3 + member++];
+      if (counters->time_running > 0 && counters->time_running < counters->time_enabled) {
+        value = (unsigned long long)((double)value * (double)counters->time_enabled / (double)counters->time_running);
+      }
+      counters->values[i] = value;
+    }
+  }
+#else
+  (void)counters;
+#endif
+}
+
+static inline int perf_counter_available(const perf_counters *counters, int counter) {
+  return counters->fds[counter] >= 0;
+}
+
+// Print the counters and the derived ratios to stderr, so they never mix with the program output
+static inline void perf_counters_report(const perf_counters *counters) {
+  fprintf(stderr, "\nPerformance counters:\n");
+  if (counters->leader >= 0 && counters->time_running == 0) {
+    // The group never got onto the PMU, e.g. more counters than the PMU has free
+    fprintf(stderr, "  not counted, the counters could not be scheduled together\n");
+    return;
+  }
+
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (perf_counter_available(counters, i)) {
+      fprintf(stderr, "  %-16s %llu\n", perf_counter_names[i], counters->values[i]);
+    } else {
+      fprintf(stderr, "  %-16s not available\n", perf_counter_names[i]);
+    }
+  }
+  if (perf_counter_available(counters, PERF_CYCLES) && perf_counter_available(counters, PERF_INSTRUCTIONS) &&
+      counters->values[PERF_CYCLES] > 0) {
+    fprintf(stderr, "  %-16s %.3f\n", "IPC",
+            (double)counters->values[PERF_INSTRUCTIONS] / (double)counters->values[PERF_CYCLES]);
+  }
+  if (perf_counter_available(counters, PERF_BRANCHES) && perf_counter_available(counters, PERF_BRANCH_MISSES) &&
+      counters->values[PERF_BRANCHES] > 0) {
+    fprintf(stderr, "  %-16s %.3f%%\n", "branch-miss-rate",
+            100.0 * (double)counters->values[PERF_BRANCH_MISSES] / (double)counters->values[PERF_BRANCHES]);
+  }
+  if (counters->time_running < counters->time_enabled) {
+    fprintf(stderr, "  multiplexed: counted %.1f%% of the time, values are scaled estimates\n",
+            100.0 * (double)counters->time_running / (double)counters->time_enabled);
+  }
+}
+
+static inline void perf_counters_close(perf_counters *counters) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+      counters->fds[i] = -1;
+    }
+  }
+  counters->leader = -1;
+#else
+  (void)counters;
+#endif
+}
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,109 @@
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+// Wall-clock timing of the pipeline stages (load, filter, bracket match, codegen, execute, ...).
+// Phases can nest. The result is printed as a summary table and/or written as a Chrome
+// trace-event JSON file that can be opened in chrome://tracing or https://ui.perfetto.dev.
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class phase_timer {
+public:
+  phase_timer() : origin(std::chrono::steady_clock::now()) {}
+
+  // Start a phase, it ends with the matching call to end()
+  void begin(const std::string &name) {
+    open_phases.push_back(phases.size());
+    phases.push_back({name, elapsed_us(), 0.0, (int)open_phases.size() - 1});
+  }
+
+  void end() {
+    if (open_phases.empty()) {
+      return;
+    }
+    phase &current = phases[open_phases.back()];
+    current.duration_us = elapsed_us() - current.start_us;
+    open_phases.pop_back();
+  }
+
+  // Table of every phase in start order, nested phases are indented under their parent
+  void print_summary(std::ostream &out) const {
+    double total_us = 0;
+    for (const phase &p : phases) {
+      if (p.depth == 0) {
+        total_us += p.duration_us;
+      }
+    }
+    out << "\nPhase timings:" << std::endl;
+    for (const phase &p : phases) {
+      out << "  " << std::left << std::setw(24) << (std::string(2 * p.depth, ' ') + p.name)
+          << std::right << std::fixed << std::setprecision(3) << std::setw(12) << p.duration_us / 1000.0 << " ms"
+          << std::setw(8) << std::setprecision(1) << (total_us > 0 ? 100.0 * p.duration_us / total_us : 0.0) << " %"
+          << std::endl;
+    }
+    out << "  " << std::left << std::setw(24) << "total" << std::right << std::setprecision(3) << std::setw(12)
+        << total_us / 1000.0 << " ms" << std::endl;
+    out.unsetf(std::ios::floatfield);
+  }
+
+  // Chrome trace-event format, one complete ("X") event per phase
+  bool write_trace(const std::string &file_name, const std::string &process_name) const {
+    std::ofstream trace(file_name);
+    if (!trace.is_open()) {
+      return false;
+    }
+    trace << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    trace << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \""
+          << json_escape(process_name) << "\"}}";
+    trace << std::fixed << std::setprecision(3);
+    for (const phase &p : phases) {
+      trace << ",\n  {\"name\": \"" << json_escape(p.name) << "\", \"cat\": \"pipeline\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1"
+            << ", \"ts\": " << p.start_us << ", \"dur\": " << p.duration_us << "}";
+    }
+    trace << "\n]}\n";
+    return trace.good();
+  }
+
+private:
+  struct phase {
+    std::string name;
+    double start_us;
+    double duration_us;
+    int depth;
+  };
+
+  // Quote characters that are not allowed raw in a JSON string (paths may contain '"' or '\\')
+  static std::string json_escape(const std::string &text) {
+    static const char hex[] = "0123456789abcdef";
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char ch : text) {
+      if (ch == '"' || ch == '\\') {
+        escaped += '\\';
+        escaped += ch;
+      } else if ((unsigned char)ch < 0x20) {
+        escaped += "\\u00";
+        escaped += hex[(unsigned char)ch >> 4];
+        escaped += hex[ch & 0xf];
+      } else {
+        escaped += ch;
+      }
+    }
+    return escaped;
+  }
+
+  double elapsed_us() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  std::chrono::steady_clock::time_point origin;
+  std::vector<phase> phases;
+  std::vector<size_t> open_phases;
+};
+
+#endif // PHASE_TIMER_H
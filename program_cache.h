@@ -0,0 +1,393 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+// On-disk cache of preprocessed programs, shared by the C and C++ interpreters and the compiler.
+// Entries are named after a hash of the raw source and the engine tag (which encodes the engine
+// and its options), so an unchanged program skips filtering and bracket matching on later runs.
+// The hash is SipHash-1-3 keyed with a random secret kept in the cache directory: it runs at
+// several GB/s, and without the secret a crafted source cannot be made to collide with another
+// program's entry.
+//
+// Interpreter entries hold the filtered text (null-terminated) followed by the loop map as an
+// int32 array, laid out so a hit is used straight from the read-only mapping. The compiler
+// caches the generated assembly as a plain file next to them. Only the cache directory's owner
+// can write entries, so a hit is checked for fitting in its file but not re-validated cell by
+// cell. The least recently used entries are removed once the cache grows past
+// $BF_CACHE_MAX_MB megabytes (1024 by default).
+//
+// The cache lives in $BF_CACHE_DIR, or $XDG_CACHE_HOME/bfinterpreter, or ~/.cache/bfinterpreter.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PROGRAM_CACHE_MAGIC "BFCACHE3"
+#define PROGRAM_CACHE_DEFAULT_MAX_MB 1024
+
+typedef struct {
+  uint64_t hash;
+} program_cache_key;
+
+typedef struct {
+  char magic[8];
+  program_cache_key source_key; // keyed hash of the engine tag and the raw source
+  uint64_t source_length;       // length of the raw source
+  uint64_t length;              // length of the filtered text
+  uint64_t loop_map_offset;     // file offset of the int32 loop map, 8-byte aligned
+} program_cache_header;
+
+typedef struct {
+  const char *text;         // filtered program, null-terminated
+  const int32_t *loop_map;  // matching bracket position for every '[' and ']'
+  uint64_t length;
+  void *mapping;
+  size_t mapped_size;
+} program_cache_entry;
+
+// Find the cache directory, creating it if needed (owner only). Returns 0 on success.
+static inline int program_cache_dir(char *dir, size_t size) {
+  const char *base = getenv("BF_CACHE_DIR");
+  int written;
+  if (base && *base) {
+    written = snprintf(dir, size, "%s", base);
+  } else if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME")) {
+    written = snprintf(dir, size, "%s/bfinterpreter", getenv("XDG_CACHE_HOME"));
+  } else if (getenv("HOME")) {
+    written = snprintf(dir, size, "%s/.cache/bfinterpreter", getenv("HOME"));
+  } else {
+    return -1;
+  }
+  if (written < 0 || written >= (int)size) {
+    return -1;
+  }
+
+  // mkdir -p
+  for (char *c = dir + 1; ; c++) {
+    if (*c == '/' || *c == '\0') {
+      char saved = *c;
+      *c = '\0';
+      if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+      }
+      *c = saved;
+      if (saved == '\0') {
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Read the cache's 128-bit secret, creating it on first use. It is written under a temporary
+// name and linked into place, so concurrent first runs all end up with the same secret.
+static inline int program_cache_secret(uint64_t secret[2]) {
+  char dir[4096];
+  char path[4096 + 32];
+  if (program_cache_dir(dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/secret", dir);
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+      ssize_t count = read(fd, secret, 2 * sizeof(uint64_t));
+      close(fd);
+      return count == (ssize_t)(2 * sizeof(uint64_t)) ? 0 : -1;
+    }
+
+    uint64_t fresh[2];
+    int random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd < 0) {
+      return -1;
+    }
+    ssize_t count = read(random_fd, fresh, sizeof(fresh));
+    close(random_fd);
+    if (count != (ssize_t)sizeof(fresh)) {
+      return -1;
+    }
+
+    char temp_path[4096 + 64];
+    snprintf(temp_path, sizeof(temp_path), "%s.%ld.tmp", path, (long)getpid());
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      return -1;
+    }
+    int ok = write(fd, fresh, sizeof(fresh)) == (ssize_t)sizeof(fresh);
+    ok = (close(fd) == 0) && ok;
+    if (ok) {
+      link(temp_path, path); // fails if another run created the secret first, theirs is read back
+    }
+    unlink(temp_path);
+  }
+  return -1;
+}
+
+#define PROGRAM_CACHE_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+typedef struct {
+  uint64_t v[4];
+  unsigned char tail[8];
+  size_t tail_length;
+  uint64_t total_length;
+} program_cache_siphash;
+
+static inline void program_cache_sipround(uint64_t v[4]) {
+  v[0] += v[1];
+  v[1] = PROGRAM_CACHE_ROTL(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = PROGRAM_CACHE_ROTL(v[0], 32);
+  v[2] += v[3];
+  v[3] = PROGRAM_CACHE_ROTL(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = PROGRAM_CACHE_ROTL(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = PROGRAM_CACHE_ROTL(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = PROGRAM_CACHE_ROTL(v[2], 32);
+}
+
+static inline uint64_t program_cache_load_le64(const unsigned char *bytes) {
+  uint64_t word = 0;
+  for (int i = 7; i >= 0; i--) {
+    word = (word << 8) | bytes[i];
+  }
+  return word;
+}
+
+// One compression round per 64-bit word (the 1 of SipHash-1-3)
+static inline void program_cache_siphash_word(program_cache_siphash *sip, uint64_t word) {
+  sip->v[3] ^= word;
+  program_cache_sipround(sip->v);
+  sip->v[0] ^= word;
+}
+
+static inline void program_cache_siphash_update(program_cache_siphash *sip, const unsigned char *data, size_t length) {
+  sip->total_length += length;
+  while (sip->tail_length > 0 && sip->tail_length < 8 && length > 0) {
+    sip->tail[sip->tail_length++] = *data++;
+    length--;
+  }
+  if (sip->tail_length == 8) {
+    program_cache_siphash_word(sip, program_cache_load_le64(sip->tail));
+    sip->tail_length = 0;
+  }
+  for (; length >= 8; data += 8, length -= 8) {
+    program_cache_siphash_word(sip, program_cache_load_le64(data));
+  }
+  memcpy(sip->tail, data, length);
+  sip->tail_length += length;
+}
+
+// The engine tag and its terminating null come first, so no tag and source pair can be
+// rearranged into another with the same input to the hash. Returns 0 on success.
+static inline int program_cache_hash(const char *source, size_t length, const char *engine, program_cache_key *key) {
+  uint64_t secret[2];
+  if (program_cache_secret(secret) != 0) {
+    return -1;
+  }
+
+  program_cache_siphash sip;
+  sip.v[0] = secret[0] ^ 0x736f6d6570736575ULL;
+  sip.v[1] = secret[1] ^ 0x646f72616e646f6dULL;
+  sip.v[2] = secret[0] ^ 0x6c7967656e657261ULL;
+  sip.v[3] = secret[1] ^ 0x7465646279746573ULL;
+  sip.tail_length = 0;
+  sip.total_length = 0;
+  program_cache_siphash_update(&sip, (const unsigned char *)engine, strlen(engine) + 1);
+  program_cache_siphash_update(&sip, (const unsigned char *)source, length);
+
+  // Last word: the remaining bytes with the low byte of the total length on top
+  uint64_t last = (uint64_t)(sip.total_length & 0xff) << 56;
+  for (size_t i = 0; i < sip.tail_length; i++) {
+    last |= (uint64_t)sip.tail[i] << (8 * i);
+  }
+  program_cache_siphash_word(&sip, last);
+  sip.v[2] ^= 0xff;
+  for (int i = 0; i < 3; i++) {
+    program_cache_sipround(sip.v);
+  }
+  key->hash = sip.v[0] ^ sip.v[1] ^ sip.v[2] ^ sip.v[3];
+  return 0;
+}
+
+// Build "<cache dir>/<hash>.<extension>", creating the cache directory if needed. Returns 0 on success.
+static inline int program_cache_path(char *path, size_t size, const program_cache_key *key, const char *extension) {
+  char dir[4096];
+  if (program_cache_dir(dir, sizeof(dir)) != 0) {
+    return -1;
+  }
+  int written = snprintf(path, size, "%s/%016llx.%s", dir, (unsigned long long)key->hash, extension);
+  return (written < 0 || written >= (int)size) ? -1 : 0;
+}
+
+// Mark an entry as recently used, the trimming below removes the oldest entries first
+static inline void program_cache_touch(const char *path) {
+  utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+typedef struct {
+  char name[256];
+  time_t used;
+  uint64_t size;
+} program_cache_file;
+
+static inline int program_cache_file_compare(const void *a, const void *b) {
+  time_t used_a = ((const program_cache_file *)a)->used;
+  time_t used_b = ((const program_cache_file *)b)->used;
+  return (used_a > used_b) - (used_a < used_b);
+}
+
+// Remove the least recently used entries until the cache fits in $BF_CACHE_MAX_MB
+static inline void program_cache_trim(void) {
+  char dir[4096];
+  if (program_cache_dir(dir, sizeof(dir)) != 0) {
+    return;
+  }
+  uint64_t max_bytes = (uint64_t)PROGRAM_CACHE_DEFAULT_MAX_MB << 20;
+  if (getenv("BF_CACHE_MAX_MB") && *getenv("BF_CACHE_MAX_MB")) {
+    max_bytes = strtoull(getenv("BF_CACHE_MAX_MB"), NULL, 10) << 20;
+  }
+
+  DIR *listing = opendir(dir);
+  if (!listing) {
+    return;
+  }
+  program_cache_file *files = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  uint64_t total = 0;
+  struct dirent *item;
+  while ((item = readdir(listing)) != NULL) {
+    // Only entries, never the secret or another run's temporary files
+    const char *extension = strrchr(item->d_name, '.');
+    if (!extension || (strcmp(extension, ".bfc") != 0 && strcmp(extension, ".asm") != 0) ||
+        strlen(item->d_name) >= sizeof(files[0].name)) {
+      continue;
+    }
+    char path[4096 + 256];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, item->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      program_cache_file *grown = (program_cache_file *)realloc(files, capacity * sizeof(*files));
+      if (!grown) {
+        break;
+      }
+      files = grown;
+    }
+    strcpy(files[count].name, item->d_name);
+    files[count].used = st.st_mtime;
+    files[count].size = (uint64_t)st.st_size;
+    total += files[count].size;
+    count++;
+  }
+  closedir(listing);
+
+  if (total > max_bytes) {
+    qsort(files, count, sizeof(*files), program_cache_file_compare);
+    for (size_t i = 0; i < count && total > max_bytes; i++) {
+      char path[4096 + 256];
+      snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+      if (unlink(path) == 0) {
+        total -= files[i].size;
+      }
+    }
+  }
+  free(files);
+}
+
+// Map a cached program. Returns 0 on a hit; any missing, stale or truncated entry is a miss.
+static inline int program_cache_load(const char *path, const program_cache_key *key, uint64_t source_length,
+                                     program_cache_entry *entry) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(program_cache_header)) {
+    close(fd);
+    return -1;
+  }
+  void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return -1;
+  }
+
+  // The header must describe a text and loop map that fit in the file
+  const program_cache_header *header = (const program_cache_header *)mapping;
+  if (memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->source_key.hash != key->hash || header->source_length != source_length ||
+      header->length > INT32_MAX || header->loop_map_offset > (uint64_t)st.st_size ||
+      header->loop_map_offset % sizeof(int32_t) != 0 ||
+      header->loop_map_offset < sizeof(*header) + header->length + 1 ||
+      header->loop_map_offset + header->length * sizeof(int32_t) > (uint64_t)st.st_size ||
+      ((const char *)mapping)[sizeof(*header) + header->length] != '\0') {
+    munmap(mapping, (size_t)st.st_size);
+    return -1;
+  }
+  program_cache_touch(path);
+
+  entry->text = (const char *)mapping + sizeof(*header);
+  entry->loop_map = (const int32_t *)((const char *)mapping + header->loop_map_offset);
+  entry->length = header->length;
+  entry->mapping = mapping;
+  entry->mapped_size = (size_t)st.st_size;
+  return 0;
+}
+
+static inline void program_cache_release(program_cache_entry *entry) {
+  if (entry->mapping) {
+    munmap(entry->mapping, entry->mapped_size);
+    entry->mapping = NULL;
+  }
+}
+
+// Write an entry through a temporary file renamed into place, so concurrent runs never see a
+// partial entry. Failures are silent, the cache is only an accelerator. Returns 0 on success.
+static inline int program_cache_store(const char *path, const program_cache_key *key, uint64_t source_length,
+                                      const char *text, uint64_t length, const int32_t *loop_map) {
+  char temp_path[4096 + 32];
+  snprintf(temp_path, sizeof(temp_path), "%s.%ld.tmp", path, (long)getpid());
+
+  program_cache_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+  header.source_key = *key;
+  header.source_length = source_length;
+  header.length = length;
+  header.loop_map_offset = (sizeof(header) + length + 1 + 7) & ~(uint64_t)7;
+
+  FILE *file = fopen(temp_path, "wb");
+  if (!file) {
+    return -1;
+  }
+  static const char padding[8] = {0};
+  size_t padding_length = header.loop_map_offset - (sizeof(header) + length);
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(text, 1, length, file) == length &&
+           fwrite(padding, 1, padding_length, file) == padding_length &&
+           fwrite(loop_map, sizeof(int32_t), length, file) == length;
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(temp_path, path) != 0) {
+    remove(temp_path);
+    return -1;
+  }
+  program_cache_trim();
+  return 0;
+}
+
+#endif // PROGRAM_CACHE_H
@@ -0,0 +1,201 @@
+import argparse
+import csv
+import hashlib
+import json
+import os
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(SCRIPT_DIR)
+
+# Interpreters are run directly on the source file, the compiler goes through nasm/ld first
+INTERPRETERS = {
+    "cpp": "brainfuck_interpreter_cpp",
+    "c": "brainfuck_interpreter_c",
+    "c_threaded": "brainfuck_interpreter_c_threaded",
+}
+ENGINES = list(INTERPRETERS) + ["compiled"]
+
+# Each engine's main wraps the program output with its own reporting lines
+LEADING_NOISE = re.compile(rb"\AProgram Length: \d+\n")
+TRAILING_NOISE = re.compile(rb"\nTime taken: [^\n]*\n\Z")
+
+
+def strip_engine_output(output):
+    output = LEADING_NOISE.sub(b"", output)
+    return TRAILING_NOISE.sub(b"", output)
+
+
+def checksum(output):
+    return hashlib.sha256(output).hexdigest()
+
+
+def percentile(samples, p):
+    # Nearest-rank percentile, good enough for a handful of repetitions
+    ordered = sorted(samples)
+    rank = max(1, -(-len(ordered) * p // 100))
+    return ordered[int(rank) - 1]
+
+
+def run(command, timeout):
+    start = time.perf_counter()
+    result = subprocess.run(command, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE, timeout=timeout)
+    elapsed = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError(" ".join(command) + " exited with " + str(result.returncode) + ": " +
+                           result.stderr.decode(errors="replace").strip())
+    return elapsed, result.stdout
+
+
+def build_compiled(bin_dir, scratch_dir, source):
+    # Returns the path of the linked executable, or None if the toolchain is missing
+    if shutil.which("nasm") is None or shutil.which("ld") is None:
+        return None
+    name = os.path.splitext(os.path.basename(source))[0]
+    asm_file = os.path.join(scratch_dir, name + ".asm")
+    obj_file = os.path.join(scratch_dir, name + ".o")
+    exe_file = os.path.join(scratch_dir, name)
+    subprocess.run([os.path.join(bin_dir, "brainfuck_compiler"), source, asm_file],
+                   check=True, stdout=subprocess.DEVNULL)
+    subprocess.run(["nasm", "-f", "elf64", asm_file, "-o", obj_file], check=True)
+    subprocess.run(["ld", obj_file, "-o", exe_file], check=True)
+    return exe_file
+
+
+def engine_command(engine, bin_dir, scratch_dir, source):
+    if engine == "compiled":
+        exe_file = build_compiled(bin_dir, scratch_dir, source)
+        return [exe_file] if exe_file else None
+    return [os.path.join(bin_dir, INTERPRETERS[engine]), source]
+
+
+def count_instructions(bin_dir, source, timeout):
+    # The C++ interpreter's profiler prints per-instruction execution counts after the program output
+    _, output = run([os.path.join(bin_dir, INTERPRETERS["cpp"]), source, "-p"], timeout)
+    counts = output.split(b"Instruction counts:\n", 1)[-1].split(b"\n\n", 1)[0]
+    return sum(int(line.rsplit(b":", 1)[1]) for line in counts.splitlines() if line)
+
+
+def update_expected(args, benchmarks, expected):
+    for name in benchmarks:
+        source = os.path.join(args.benchmarks_dir, name + ".b")
+        _, output = run([os.path.join(args.bin_dir, INTERPRETERS["c"]), source], args.timeout)
+        expected[name] = {
+            "sha256": checksum(strip_engine_output(output)),
+            "instructions": count_instructions(args.bin_dir, source, args.timeout),
+        }
+        print("Recorded " + name + ": " + str(expected[name]["instructions"]) + " instructions")
+    with open(args.expected, "w") as expected_file:
+        json.dump(expected, expected_file, indent=2, sort_keys=True)
+        expected_file.write("\n")
+
+
+def measure(command, reference, args):
+    samples = []
+    status = "ok"
+    try:
+        for _ in range(args.warmup):
+            run(command, args.timeout)
+        for _ in range(args.repetitions):
+            elapsed, output = run(command, args.timeout)
+            samples.append(elapsed)
+            output_sum = checksum(strip_engine_output(output))
+            if "sha256" in reference and output_sum != reference["sha256"]:
+                status = "mismatch"
+    except subprocess.TimeoutExpired:
+        status = "timeout"
+    except RuntimeError as error:
+        print(error, file=sys.stderr)
+        status = "error"
+    return samples, status
+
+
+def bench(args, benchmarks, expected):
+    results = []
+    failures = 0
+    for name in benchmarks:
+        source = os.path.join(args.benchmarks_dir, name + ".b")
+        reference = expected.get(name, {})
+        for engine in args.engines:
+            command = engine_command(engine, args.bin_dir, args.scratch_dir, source)
+            if command is None:
+                # Still recorded as a row, so a run that lost an engine can't pass for a complete one
+                print("Skipping " + engine + "/" + name + ": nasm or ld not found", file=sys.stderr)
+                samples, status = [], "skipped"
+            else:
+                samples, status = measure(command, reference, args)
+
+            row = {"benchmark": name, "engine": engine, "status": status,
+                   "repetitions": len(samples), "median_s": None, "p95_s": None, "instructions_per_s": None}
+            if samples:
+                row["median_s"] = statistics.median(samples)
+                row["p95_s"] = percentile(samples, 95)
+                if reference.get("instructions"):
+                    row["instructions_per_s"] = reference["instructions"] / row["median_s"]
+            if status != "ok":
+                failures += 1
+            results.append(row)
+            print_row(row)
+    return results, failures
+
+
+def print_row(row):
+    def fmt(value, spec):
+        return format(value, spec) if value is not None else "-"
+    print("{:<14} {:<12} {:<9} median {:>10}s  p95 {:>10}s  {:>10} ins/s".format(
+        row["benchmark"], row["engine"], row["status"],
+        fmt(row["median_s"], ".4f"), fmt(row["p95_s"], ".4f"), fmt(row["instructions_per_s"], ".3e")))
+
+
+def write_results(results, csv_path, json_path):
+    fields = ["benchmark", "engine", "status", "repetitions", "median_s", "p95_s", "instructions_per_s"]
+    with open(csv_path, "w", newline="") as csv_file:
+        writer = csv.DictWriter(csv_file, fieldnames=fields)
+        writer.writeheader()
+        writer.writerows(results)
+    with open(json_path, "w") as json_file:
+        json.dump(results, json_file, indent=2)
+        json_file.write("\n")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Run the benchmarks on every engine and verify their output")
+    parser.add_argument("--bin-dir", default=os.path.join(REPO_DIR, "build", "bin"))
+    parser.add_argument("--benchmarks-dir", default=os.path.join(REPO_DIR, "benchmarks"))
+    parser.add_argument("--expected", default=os.path.join(REPO_DIR, "benchmarks", "expected.json"))
+    parser.add_argument("--scratch-dir", default=os.path.join(os.getcwd(), "bench"))
+    parser.add_argument("--engines", nargs="+", choices=ENGINES, default=ENGINES)
+    parser.add_argument("--benchmarks", nargs="+", help="benchmark names without the .b extension")
+    parser.add_argument("--warmup", type=int, default=1)
+    parser.add_argument("--repetitions", type=int, default=3)
+    parser.add_argument("--timeout", type=float, default=600, help="seconds per run")
+    parser.add_argument("--update-expected", action="store_true",
+                        help="record output checksums and instruction counts instead of benchmarking")
+    args = parser.parse_args()
+
+    os.makedirs(args.scratch_dir, exist_ok=True)
+    benchmarks = args.benchmarks or sorted(os.path.splitext(f)[0] for f in os.listdir(args.benchmarks_dir)
+                                           if f.endswith(".b"))
+    expected = {}
+    if os.path.exists(args.expected):
+        with open(args.expected) as expected_file:
+            expected = json.load(expected_file)
+
+    if args.update_expected:
+        update_expected(args, benchmarks, expected)
+        sys.exit(0)
+
+    results, failures = bench(args, benchmarks, expected)
+    write_results(results, os.path.join(args.scratch_dir, "results.csv"),
+                  os.path.join(args.scratch_dir, "results.json"))
+    print("Results written to " + args.scratch_dir)
+    if failures:
+        print(str(failures) + " runs did not pass; leave out engines that can't run here with --engines",
+              file=sys.stderr)
+    sys.exit(1 if failures else 0)
@@ -6,7 +6,7 @@ if __name__ == '__main__':
     path = sys.argv[1]
 
     enable_profiler = False
-    if sys.argv[2] == "-p":
+    if len(sys.argv) > 2 and sys.argv[2] == "-p":
         enable_profiler = True
 
     scratch_dir = os.getcwd() + "/../scratch/"
@@ -16,13 +16,21 @@ if __name__ == '__main__':
     full_root = os.path.abspath(root)
     filename = os.path.splitext(os.path.basename(path))[0]
 
-    # Call the bf_compiler on the filename
+    # Call the bf_compiler on the filename, it reports its own phase timings
     os.system("../build-debug/bin/brainfuck_compiler " +
               root + '/' + filename + ".b " +
               scratch_dir + filename + ".asm" +
-              " -p" if enable_profiler else "")
+              (" -p" if enable_profiler else "") + " --phases")
+
+    start = time.time()
     os.system("nasm -f elf64 " + scratch_dir + filename + ".asm")
+    end = time.time()
+    print("Assemble time: ", end-start, " seconds")
+
+    start = time.time()
     os.system("ld " + scratch_dir + filename + ".o -o " + scratch_dir + filename)
+    end = time.time()
+    print("Link time: ", end-start, " seconds")
 
     print("\n")
     # Measure execution time of next command